@@ -20,16 +20,23 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef ALLOCATOR_H_INCLUDED
 #define ALLOCATOR_H_INCLUDED
 
-#define __REPORT_ALLOCS__
-
 #include <utility>	// pair
 #include <algorithm>	// max
 #include <new>	// bad_alloc
-#include <stdlib.h>	// malloc/free
-
-#ifdef __REPORT_ALLOCS__
-	#include <iostream>
-	#include <cmath>
+#include <stdlib.h>	// malloc/free/posix_memalign
+#include <malloc.h>	// malloc_usable_size
+#include <stdint.h>	// uintptr_t
+#include <pthread.h>	// thread exit hook for per-thread block lists
+#include <sys/mman.h>	// mmap/madvise for mmap_chunks
+#include <unistd.h>	// sysconf, syscall
+#include <stdio.h>	// reading the node topology from sysfs, check reports
+#include <string.h>	// memset/strstr for checked_slots
+#include <sched.h>	// sched_getcpu
+#include <sys/syscall.h>	// getcpu/mbind without libnuma
+
+#if __cplusplus >= 201103L
+	#include <type_traits>	// true_type/false_type
+	#include <memory>	// allocator_traits for budget_allocator
 #endif
 
 namespace cutepig {
@@ -41,6 +48,111 @@ namespace cutepig {
 	template<> struct __int_32_64<8> { typedef __uint64_t type; };
 	struct int_32_64 { typedef typename __int_32_64<sizeof(int*)>::type type; };
 
+	// assumed size of a cache line
+	static const size_t cache_line_size = 64;
+
+	// helper to round a compile time size up to the next power of two
+	template<size_t __n, size_t __p = 1, bool __done = (__p >= __n)>
+	struct __pow2_ceil { static const size_t value = __pow2_ceil<__n, __p * 2>::value; };
+	template<size_t __n, size_t __p>
+	struct __pow2_ceil<__n, __p, true> { static const size_t value = __p; };
+
+	// index of the lowest set bit (x must not be 0)
+	inline int __bitscan(__uint32_t x) { return __builtin_ctz(x); }
+	inline int __bitscan(__uint64_t x) { return __builtin_ctzll(x); }
+
+	//=============================================
+
+	// allocation statistics, see counting_stats
+	struct alloc_stats {
+		// allocations by size, bucket i counts sizes in [2^(i-1), 2^i)
+		static const int histogram_size = 24;
+
+		size_t live_bytes;
+		size_t peak_bytes;
+		size_t allocations;
+		size_t deallocations;
+		size_t blocks_allocated;	// block churn (block_allocator only)
+		size_t blocks_freed;
+		size_t histogram[histogram_size];
+	};
+
+	/*
+		Instrumentation policies. Allocators call these for every allocation,
+		so they have to be cheap. null_stats is the default and compiles to nothing.
+	*/
+	struct null_stats {
+		static void allocated(size_t) {}
+		static void deallocated(size_t) {}
+		static void block_allocated(size_t) {}
+		static void block_freed(size_t) {}
+	};
+
+	// plain counters, safe to use from many threads.
+	// Tag selects the set of counters, eg. use a different one per container
+	template<typename Tag = void>
+	struct counting_stats {
+		// the live counters, read them with get()
+		static alloc_stats &stats() {
+			static alloc_stats s;
+			return s;
+		}
+		// (alloc_stats is all size_t counters, copy them one by one)
+		static alloc_stats get() {
+			alloc_stats r;
+			size_t *src = reinterpret_cast<size_t*>(&stats()), *dst = reinterpret_cast<size_t*>(&r);
+			for(size_t i = 0; i < sizeof(alloc_stats) / sizeof(size_t); i++)
+				dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+			return r;
+		}
+		static void reset() {
+			size_t *dst = reinterpret_cast<size_t*>(&stats());
+			for(size_t i = 0; i < sizeof(alloc_stats) / sizeof(size_t); i++)
+				__atomic_store_n(&dst[i], size_t(0), __ATOMIC_RELAXED);
+		}
+
+		static void allocated(size_t n) {
+			alloc_stats &s = stats();
+			size_t live = __atomic_add_fetch(&s.live_bytes, n, __ATOMIC_RELAXED);
+			size_t peak = __atomic_load_n(&s.peak_bytes, __ATOMIC_RELAXED);
+			while(live > peak && !__atomic_compare_exchange_n(&s.peak_bytes, &peak, live,
+				true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+			__atomic_add_fetch(&s.allocations, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&s.histogram[bucket(n)], 1, __ATOMIC_RELAXED);
+		}
+		static void deallocated(size_t n) {
+			alloc_stats &s = stats();
+			__atomic_sub_fetch(&s.live_bytes, n, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&s.deallocations, 1, __ATOMIC_RELAXED);
+		}
+		static void block_allocated(size_t) {
+			__atomic_add_fetch(&stats().blocks_allocated, 1, __ATOMIC_RELAXED);
+		}
+		static void block_freed(size_t) {
+			__atomic_add_fetch(&stats().blocks_freed, 1, __ATOMIC_RELAXED);
+		}
+
+		// histogram bucket of size n (bit length, last bucket takes the rest)
+		static int bucket(size_t n) {
+			int b = n ? int(sizeof(unsigned long long) * 8) - __builtin_clzll(n) : 0;
+			return b < alloc_stats::histogram_size ? b : alloc_stats::histogram_size - 1;
+		}
+	};
+
+	//=============================================
+
+	// minimal spinlock, only for slow paths (zero initialized state is unlocked)
+	struct __spinlock {
+		volatile int locked;
+		void lock() {
+			while(__sync_lock_test_and_set(&locked, 1))
+				while(__atomic_load_n(&locked, __ATOMIC_RELAXED))
+					;
+		}
+		void unlock() { __sync_lock_release(&locked); }
+	};
+
 	//=============================================
 
 	// for copy/paste reference purposes only. unusable
@@ -101,19 +213,36 @@ namespace cutepig {
 
 	// so lets implement some allocator
 
-	// allocator class
-	template <class T> class malloc_allocator;
+	// what allocate_at_least gives, the memory and how many objects really fit in it
+#if defined(__cpp_lib_allocate_at_least)
+	using std::allocation_result;
+#else
+	template <typename Pointer, typename SizeType = size_t>
+	struct allocation_result {
+		Pointer ptr;
+		SizeType count;
+	};
+#endif
+
+	// T can be moved to another address by copying its bytes (realloc, mremap).
+	// specialize for types that can be but are not trivially copyable
+	template <typename T> struct trivially_relocatable {
+		static const bool value = __is_trivially_copyable(T);
+	};
+
+	// allocator class, Stats is the instrumentation policy (see null_stats)
+	template <class T, typename Stats = null_stats> class malloc_allocator;
 	// specialize for void:
-	template <> class malloc_allocator<void> {
+	template <typename Stats> class malloc_allocator<void, Stats> {
 	public:
 		typedef void*       pointer;
 		typedef const void* const_pointer;
 		//  reference-to-void members are impossible.
 		typedef void  value_type;
-		template <class U> struct rebind { typedef malloc_allocator<U> other; };
+		template <class U> struct rebind { typedef malloc_allocator<U, Stats> other; };
 	};
 
-	template<typename T>
+	template<typename T, typename Stats>
 	class malloc_allocator {
 	public:
 		typedef size_t    size_type;
@@ -123,11 +252,11 @@ namespace cutepig {
 		typedef T&        reference;
 		typedef const T&  const_reference;
 		typedef T         value_type;
-		template <class U> struct rebind { typedef malloc_allocator<U> other; };
+		template <class U> struct rebind { typedef malloc_allocator<U, Stats> other; };
 
 		malloc_allocator() throw() {}
 		malloc_allocator(const malloc_allocator &/*other*/) throw() {}
-		template<typename U> malloc_allocator(const malloc_allocator<U>&) throw() {}
+		template<typename U> malloc_allocator(const malloc_allocator<U, Stats>&) throw() {}
 
 		~malloc_allocator() throw() {}
 
@@ -137,13 +266,28 @@ namespace cutepig {
 		const_pointer address(const_reference x) const
 		{ return &x; }
 		size_type max_size() const throw()
-		{ return 0x8000000; }
+		{ return size_type(-1) / sizeof(T); }
 
 		void construct(pointer p, const T& val)
 		{ new(p) T(val); }
 		void destroy(pointer p)
 		{ p->~T(); }
 
+#if __cplusplus >= 201103L
+		// C++11 allocator_traits
+		typedef std::true_type propagate_on_container_copy_assignment;
+		typedef std::true_type propagate_on_container_move_assignment;
+		typedef std::true_type propagate_on_container_swap;
+		typedef std::true_type is_always_equal;
+
+		template<typename U, typename... Args>
+		void construct(U *p, Args&&... args)
+		{ ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+		template<typename U>
+		void destroy(U *p)
+		{ p->~U(); }
+#endif
+
 		// to copy ctor or compare with private data, do this
 		template<typename U>
 		friend class __base_allocator;
@@ -153,42 +297,216 @@ namespace cutepig {
 		// the "special" kind
 
 		// allocation function, just use malloc here
-		pointer allocate(size_type n, typename malloc_allocator<void>::const_pointer hint=0)
+		pointer allocate(size_type n, typename malloc_allocator<void, Stats>::const_pointer hint=0)
 		{
+			if(n > max_size())
+				throw std::bad_alloc();
 			pointer p = static_cast<pointer>( malloc(n * sizeof(T)) );
 			if(!p)
 				throw std::bad_alloc();
-			#ifdef __REPORT_ALLOCS__
-				std::cout << "malloc_allocator::allocate: " << n << " * " << sizeof(T)
-					<< ", hint: 0x" << std::hex << hint
-					<< " returning: 0x" << static_cast<malloc_allocator<void>::const_pointer>(p) << std::endl;
-			#endif
-
+			Stats::allocated(n * sizeof(T));
 			return p;
 		}
 
 		// deallocation, use free()
 		void deallocate(pointer p, size_type n)
 		{
-			#ifdef __REPORT_ALLOCS__
-				std::cout << "malloc_allocator::deallocate: " << std::hex << static_cast<malloc_allocator<void>::const_pointer>(p)
-						<< ", size " << std::dec << n << " * " << sizeof(T) << std::endl;
-			#endif
+			if(p) {
+				Stats::deallocated(n * sizeof(T));
+				free(p);
+			}
+		}
+
+		//=======================================
+
+		// growing, for buffers that would otherwise copy themselves on every
+		// doubling (see growing_buffer). counts given back are what malloc
+		// really handed out, pass them to deallocate
+
+		// objects that fit in the block at p (its slack included)
+		static size_type usable_size(const_pointer p)
+		{ return p ? malloc_usable_size(const_cast<pointer>(p)) / sizeof(T) : 0; }
+
+		// at least n objects, the count is all that fits
+		allocation_result<pointer> allocate_at_least(size_type n)
+		{
+			if(n > max_size())
+				throw std::bad_alloc();
+			allocation_result<pointer> r;
+			r.ptr = static_cast<pointer>( malloc(n * sizeof(T)) );
+			if(!r.ptr)
+				throw std::bad_alloc();
+			r.count = usable_size(r.ptr);
+			Stats::allocated(r.count * sizeof(T));
+			return r;
+		}
+
+		// grow the block at p from n to new_n objects without moving it (into
+		// its slack, so never past usable_size), false if it does not have room
+		// (then nothing changed). deallocate it with new_n after
+		bool expand(pointer p, size_type n, size_type new_n)
+		{
+			if(!p || usable_size(p) < new_n)
+				return false;
+			Stats::deallocated(n * sizeof(T));
+			Stats::allocated(new_n * sizeof(T));
+			return true;
+		}
 
+		/*
+			Resize the block at p (0 for none) from n to at least new_n objects,
+			in place if the heap can, else the bytes move. With glibc, blocks over
+			the mmap threshold move with mremap, which remaps pages instead of
+			copying them. Only for trivially_relocatable T. On bad_alloc, p is
+			still valid.
+		*/
+		allocation_result<pointer> reallocate(pointer p, size_type n, size_type new_n)
+		{
+			typedef char relocatable_check[trivially_relocatable<T>::value ? 1 : -1] __attribute__((unused));
+			if(new_n > max_size())
+				throw std::bad_alloc();
+			allocation_result<pointer> r;
+			r.ptr = static_cast<pointer>( realloc(p, (new_n ? new_n : 1) * sizeof(T)) );
+			if(!r.ptr)
+				throw std::bad_alloc();
 			if(p)
-				free(p);
+				Stats::deallocated(n * sizeof(T));
+			r.count = usable_size(r.ptr);
+			Stats::allocated(r.count * sizeof(T));
+			return r;
 		}
 	};
 
 	// then ofc these
-	template<typename T1, typename T2>
-	bool operator==(const malloc_allocator<T1> &a, const malloc_allocator<T2> &b) throw()
+	template<typename T1, typename T2, typename Stats>
+	bool operator==(const malloc_allocator<T1, Stats> &a, const malloc_allocator<T2, Stats> &b) throw()
 	{ return true; }
 
-	template<typename T1, typename T2>
-	bool operator!=(const malloc_allocator<T1> &a, const malloc_allocator<T2> &b) throw()
+	template<typename T1, typename T2, typename Stats>
+	bool operator!=(const malloc_allocator<T1, Stats> &a, const malloc_allocator<T2, Stats> &b) throw()
 	{ return false; }
 
+	/*
+		A vector for trivially_relocatable T (bytes, PODs, handles) that grows
+		with malloc_allocator::reallocate, so a large buffer is grown in place or
+		remapped instead of copied, and that uses the slack malloc hands back
+		as capacity.
+	*/
+	template <typename T, typename Stats = null_stats>
+	class growing_buffer {
+	public:
+		typedef malloc_allocator<T, Stats> allocator_type;
+		typedef size_t size_type;
+		typedef T value_type;
+		typedef T* iterator;
+		typedef const T* const_iterator;
+
+		growing_buffer() : p(0), n(0), cap(0) {}
+		growing_buffer(const growing_buffer &other) : p(0), n(0), cap(0)
+		{ append(other.begin(), other.size()); }
+		~growing_buffer() {
+			clear();
+			allocator_type().deallocate(p, cap);
+		}
+
+		growing_buffer &operator=(const growing_buffer &other) {
+			if(this != &other) {
+				clear();
+				append(other.begin(), other.size());
+			}
+			return *this;
+		}
+		void swap(growing_buffer &other) {
+			std::swap(p, other.p);
+			std::swap(n, other.n);
+			std::swap(cap, other.cap);
+		}
+
+		T *data() { return p; }
+		const T *data() const { return p; }
+		iterator begin() { return p; }
+		iterator end() { return p + n; }
+		const_iterator begin() const { return p; }
+		const_iterator end() const { return p + n; }
+		T &operator[](size_type i) { return p[i]; }
+		const T &operator[](size_type i) const { return p[i]; }
+		T &back() { return p[n - 1]; }
+		size_type size() const { return n; }
+		size_type capacity() const { return cap; }
+		bool empty() const { return !n; }
+
+		// room for at least k objects (cap is all of the block already, realloc
+		// grows it in place when the heap can)
+		void reserve(size_type k) {
+			if(k <= cap)
+				return;
+			allocation_result<T*> r = allocator_type().reallocate(p, cap, k);
+			p = r.ptr;
+			cap = r.count;
+		}
+
+		void push_back(const T &value) {
+			if(n == cap) {
+				// (value may be in here)
+				T copy(value);
+				grow(n + 1);
+				new(p + n) T(copy);
+			}
+			else
+				new(p + n) T(value);
+			n++;
+		}
+		void pop_back() {
+			p[--n].~T();
+		}
+		void append(const T *values, size_type k) {
+			if(n + k > cap) {
+				// (values may be in here)
+				size_t inside = values >= p && values < p + n ? values - p + 1 : 0;
+				grow(n + k);
+				if(inside)
+					values = p + inside - 1;
+			}
+			for(size_type i = 0; i < k; i++)
+				new(p + n + i) T(values[i]);
+			n += k;
+		}
+		void resize(size_type k, T value = T()) {
+			if(k > cap)
+				grow(k);
+			while(n > k)
+				p[--n].~T();
+			for(; n < k; n++)
+				new(p + n) T(value);
+		}
+		void clear() {
+			while(n)
+				p[--n].~T();
+		}
+		// give the slack back to the heap (the block may move)
+		void shrink_to_fit() {
+			if(!n) {
+				allocator_type().deallocate(p, cap);
+				p = 0;
+				cap = 0;
+			}
+			else if(n < cap) {
+				allocation_result<T*> r = allocator_type().reallocate(p, cap, n);
+				p = r.ptr;
+				cap = r.count;
+			}
+		}
+
+	private:
+		T *p;
+		size_type n, cap;
+
+		// at least twice the capacity
+		void grow(size_type k) {
+			reserve(std::max(k, cap * 2));
+		}
+	};
+
 	//===================================================
 
 	// another more advanced allocator, suitable for lists and maps
@@ -198,292 +516,3231 @@ namespace cutepig {
 	// this is basically a bitmap allocator, just renamed to block_allocator
 	// because it uses list of blocks where each block has N slots
 
-	// block-size policy, 32-bit and smaller objects have block-size of 32
-	// larger objects have 8 (optimize further? utilize 64-bits on 64-bit archs?)
-	template <typename T, int number_of_slots=(sizeof(T) > 4 ? 8 : 32)>
-	class block_allocator;
-
-	// specialize for void:
-	template <int number_of_slots> class block_allocator<void,number_of_slots> {
-	public:
-		typedef void*       pointer;
-		typedef const void* const_pointer;
-		//  reference-to-void members are impossible.
-		typedef void  value_type;
-		template <class U> struct rebind { typedef block_allocator<U> other; };
+	// size classes, objects of different types but similar size share blocks.
+	// multiples of 8 up to 64, of 16 up to 256 and of 64 after that (never smaller
+	// than a pointer). slots are aligned to the largest power of two dividing the
+	// size (max 64), or more if the type wants that.
+	template <size_t __size, size_t __align = 1> struct block_size_class {
+		static const size_t size =
+			__size <= sizeof(void*) ? sizeof(void*) :
+			__size <= 64 ? (__size + 7) & ~size_t(7) :
+			__size <= 256 ? (__size + 15) & ~size_t(15) :
+			(__size + 63) & ~size_t(63);
+		static const size_t natural_align = (size & (~size + 1)) < 64 ? (size & (~size + 1)) : 64;
+		static const size_t align = __align > natural_align ? __align : natural_align;
 	};
 
-	template <class T, int _number_of_slots> class block_allocator {
-	public:
-		typedef size_t    size_type;
-		typedef std::ptrdiff_t difference_type;
-		typedef T*        pointer;
-		typedef const T*  const_pointer;
-		typedef T&        reference;
-		typedef const T&  const_reference;
-		typedef T         value_type;
-
-		template <class U>
-		struct rebind { typedef block_allocator<U> other; };
-
-		//===========================
-
-		/*
-			This allocator keeps a shared list of blocks to allocate from.
-			Each block has number of slots to allocate from. Amount of slots is static,
-			while each block is dynamically allocated/free'd as necessary.
-		*/
+	// block-size policy, a block has one full bitmask word of slots
+	// (32 or 64 depending on the platform), tiny objects get more words
+	// so that a block holds at least ~1k worth of objects
+	template <size_t __size> struct block_size_slots {
+		static const int bits = sizeof(int_32_64::type) * 8;
+		static const int words = 1024 / (block_size_class<__size>::size * bits);
+		static const int value = bits * (words > 1 ? words : 1);
+	};
+	template <typename T> struct block_slots {
+		static const int value = block_size_slots<sizeof(T)>::value;
+	};
+	template <> struct block_slots<void> {
+		static const int value = sizeof(int_32_64::type) * 8;
+	};
 
-		// invidual block
-		struct block_block {
-			typedef int_32_64::type bitmask_t;
-			block_block *prev;
-			block_block *next;
-			bitmask_t slots;
-			T ptr[_number_of_slots];
-			static const bitmask_t fullmask = (1<<_number_of_slots) - 1;
+	// threading policies
+
+	// all allocators share one list of blocks, nothing is synchronized
+	struct single_thread { static const bool concurrent = false; static const int nodes = 0; };
+
+	// every thread allocates from a list of its own without any locking,
+	// slots freed by other threads are pushed to a lock-free queue on the
+	// owning list and taken back when that list runs out of room.
+	// lists of exited threads are adopted by new threads
+	struct thread_cached { static const bool concurrent = true; static const int nodes = 0; };
+
+	// one list per NUMA node (up to MaxNodes), each behind a spinlock.
+	// threads allocate from the list of the node they run on and the blocks
+	// of a list are bound to its node, a slot is freed to the list it came from
+	template <int MaxNodes = 8>
+	struct numa_local { static const bool concurrent = true; static const int nodes = MaxNodes; };
+
+	/*
+		What the NUMA lists need to know about the machine, without libnuma.
+		Nodes are read from /sys/devices/system/node/online, the node of the
+		calling thread is that of the cpu sched_getcpu gives, from a table read
+		once from the cpulist of each node. Anything that fails means one node.
+
+		simulate(n) pretends there are n nodes (cpus are spread over them, and
+		nothing is bound), set_thread_node() pins the calling thread to a node.
+		Both are for testing on machines that have only one.
+	*/
+	struct numa_topology {
+		// cpus the table knows the node of, the rest ask the kernel
+		static const int max_cpus = 1024;
+
+		// number of nodes
+		static int nodes() {
+			if(simulated())
+				return simulated();
+			static int n = read_nodes();
+			return n;
+		}
 
-			// very simple constructor
-			block_block() {
-				prev = next = 0;
-				slots = 0;
-			}
+		// node of the calling thread
+		static int current_node() {
+			if(thread_node() >= 0)
+				return thread_node();
+			int cpu = sched_getcpu();
+			if(simulated())
+				return cpu > 0 ? cpu % simulated() : 0;
+			if(cpu < 0)
+				return 0;
+			if(cpu < max_cpus)
+				return cpu_nodes().node[cpu];
+			unsigned c = 0, node = 0;
+			if(syscall(SYS_getcpu, &c, &node, (void*)0) != 0)
+				return 0;
+			return int(node);
+		}
 
-			// returns true if this block has slots available
-			bool hasroom() { return (slots & fullmask) != fullmask; }
-			// returns true if block is all empty
-			bool isempty() { return (slots == 0); }
+		static void simulate(int n) { simulated() = n; }
+		static void set_thread_node(int node) { thread_node() = node; }
+
+		// prefer 'node' for the whole pages of [p, p + n), false if nothing was bound
+		static bool bind(void *p, size_t n, int node) {
+			if(simulated() || node >= int(sizeof(unsigned long) * 8))
+				return false;
+			size_t page = size_t(sysconf(_SC_PAGESIZE));
+			uintptr_t start = (reinterpret_cast<uintptr_t>(p) + page - 1) & ~uintptr_t(page - 1);
+			uintptr_t end = (reinterpret_cast<uintptr_t>(p) + n) & ~uintptr_t(page - 1);
+			if(end <= start)
+				return false;
+			unsigned long mask = 1UL << node;
+			const int mpol_preferred = 1;
+			return syscall(SYS_mbind, start, end - start, mpol_preferred, &mask,
+				sizeof(mask) * 8, 0) == 0;
+		}
 
-			// allocate a slot (excepts that the block has been checked with hasroom)
-			pointer allocate() {
-				// unoptimized scan of non-free elements
-				for(int i = 0; i < _number_of_slots; i++) {
-					if( !(slots & (1<<i)) ) {
-						// mark allocated
-						slots |= (1<<i);
-						#ifdef __REPORT_ALLOCS__
-							std::cout << "block_block::allocate found slot " << i << " @ " << (void*)(&ptr[i]) << std::endl << std::flush;
-						#endif
-						return &ptr[i];
+	private:
+		static int &simulated() { static int n = 0; return n; }
+		static int &thread_node() { static __thread int node = -1; return node; }
+
+		// node of every cpu below max_cpus, 0 for those no cpulist names
+		struct cpu_table {
+			short node[max_cpus];
+
+			cpu_table() {
+				memset(node, 0, sizeof(node));
+				for(int n = 0; n < nodes(); n++) {
+					char path[64];
+					snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+					FILE *f = fopen(path, "r");
+					if(!f)
+						continue;
+					// "0-3,8-11"
+					int a, b;
+					while(fscanf(f, "%d", &a) == 1) {
+						b = a;
+						int c = fgetc(f);
+						if(c == '-') {
+							if(fscanf(f, "%d", &b) != 1)
+								break;
+							c = fgetc(f);
+						}
+						for(int cpu = a; cpu <= b && cpu < max_cpus; cpu++)
+							node[cpu] = short(n);
+						if(c != ',')
+							break;
 					}
+					fclose(f);
 				}
-				#ifdef __REPORT_ALLOCS__
-					std::cout << "block_block::allocate couldnt find slot " << std::endl;
-				#endif
-				return 0;
-			}
-
-			// deallocate a slot
-			void deallocate(pointer p) {
-				bitmask_t bit = (1 << (bitmask_t)(p - ptr));
-				#ifdef __REPORT_ALLOCS__
-					std::cout << "block_block::deallocate freeing slot " << int(log2(float(bit))) << " @ " << (void*)(&ptr[bit]) << std::endl << std::flush;
-				#endif
-				slots &= ~bit;
-			}
-
-			// tell me if given pointer is inside this block
-			bool inblock(pointer p) {
-				return (p >= ptr && p < &(ptr[_number_of_slots]));
 			}
 		};
+		static const cpu_table &cpu_nodes() { static cpu_table t; return t; }
+
+		// "0" or "0-1" or "0,2-3", the highest node + 1
+		static int read_nodes() {
+			FILE *f = fopen("/sys/devices/system/node/online", "r");
+			if(!f)
+				return 1;
+			int n = 0, a;
+			char sep;
+			while(fscanf(f, "%d%c", &a, &sep) >= 1)
+				n = a + 1 > n ? a + 1 : n;
+			fclose(f);
+			return n > 0 ? n : 1;
+		}
+	};
 
-		// container of blocks (refcounted so that you can share this)
-		struct block_list {
-			int_32_64::type refcount;		// keep same size as pointers for padding
-			block_block block;		// we always keep this one block here
-			block_block *head;
-			block_block *tail;
+	// what one NUMA list holds, see block_pool::usage
+	struct numa_usage {
+		size_t blocks;		// blocks in use
+		size_t cached;		// empty blocks kept
+		size_t slots;		// slots in use
+	};
 
-			block_list()
-				: refcount(1), block(), head(&block), tail(&block)
-			{}
+	/*
+		Retention policies, what a list does with blocks that become empty.
+		It keeps them cached for reuse, up to High of them. When there are more,
+		they are freed down to Low (the gap stops a list that hovers around a
+		block boundary from allocating and freeing a block on every operation).
+		With MostFullFirst, partial blocks are kept roughly in order of most
+		slots in use, so allocations concentrate on few blocks and the sparse
+		ones get a chance to empty.
+	*/
+	template <int Low = 1, int High = 4, bool MostFullFirst = true>
+	struct retain_empty {
+		static const int low = Low;
+		static const int high = High;
+		static const bool most_full_first = MostFullFirst;
+	};
 
-			// internal system allocation functions
-			void *_alloc( size_t s ) {
-				return malloc(s);
+	/*
+		Chunk providers, where the memory of the blocks comes from.
+		provider<size, align> hands out chunks of exactly 'size' bytes
+		aligned to 'align' (a power of two), allocate() returns 0 when out of memory.
+	*/
+
+	/*
+		Blocks come from the heap, carved from runs of a few chunks at a time
+		(one at first, doubling up to run_bytes) so that only each run pays
+		the gap an aligned heap allocation leaves in front of it. A run goes
+		back to the heap when the last of its chunks is released.
+
+		A chunk finds its run in a hash of the runs by the span they start in
+		(a power of two no run is longer than, so that is the span of the chunk
+		or the one before), and the runs with chunks left to hand out are on a
+		list of their own, so neither allocate nor deallocate walks all runs.
+	*/
+	struct malloc_chunks {
+		static const size_t run_bytes = 64 * 1024;
+
+		template <size_t size, size_t align> struct provider {
+			static const size_t stride = (size + align - 1) & ~(align - 1);
+			static const size_t max_chunks = stride < run_bytes ? run_bytes / stride : 1;
+			static const size_t span = __pow2_ceil<max_chunks * stride>::value;
+
+			struct run {
+				char *base;
+				size_t chunks;
+				size_t carved;		// handed out from the front so far
+				size_t live;
+				void *freed;		// released chunks, linked through their first word
+				run *hnext;		// in the bucket of its span
+				run *next;		// on the open list, while it has chunks left
+				run *prev;
+			};
+
+			static void *allocate() {
+				lock.lock();
+				run *r = open ? open : grow();
+				void *p = 0;
+				if(r) {
+					if(r->freed) {
+						p = r->freed;
+						r->freed = *static_cast<void**>(p);
+					} else
+						p = r->base + r->carved++ * stride;
+					r->live++;
+					if(full(r))
+						close(r);
+				}
+				lock.unlock();
+				return p;
 			}
-			void _free( void *p ) {
-				free( p );
+			static void deallocate(void *p) {
+				lock.lock();
+				run *r = find(static_cast<char*>(p));
+				bool was_full = full(r);
+				if(--r->live == 0) {
+					if(!was_full)
+						close(r);
+					unhash(r);
+					free(r->base);
+					free(r);
+				} else {
+					*static_cast<void**>(p) = r->freed;
+					r->freed = p;
+					if(was_full)
+						reopen(r);
+				}
+				lock.unlock();
 			}
 
-			/*
-				so, algorithm goes like this:
-				if 'head' has slots available, call
-					r = head->allocate();
-					if 'head' has no slots available and 'head' != 'tail'
-						move 'head' to 'tail'
-					(alt. approach is to 'float' 'head' towards 'tail')
-
+			static __spinlock lock;
+			static run *open;		// runs with chunks left, newest first
+			static run **buckets;		// runs by the span they start in
+			static size_t nbuckets;		// a power of two (0 before the first run)
+			static size_t nruns;
+			static size_t last;		// chunks in the last run made
+
+		private:
+			static bool full(const run *r) { return !r->freed && r->carved == r->chunks; }
+
+			static void reopen(run *r) {
+				r->prev = 0;
+				r->next = open;
+				if(open)
+					open->prev = r;
+				open = r;
+			}
+			static void close(run *r) {
+				if(r->prev)
+					r->prev->next = r->next;
 				else
-					allocate new 'head'
-					return head->allocate()		(this surely will have slots avail)
-			*/
-			pointer allocate() {
-				// blocks with free space are always in the beginning
-				if(head->hasroom()) {
-					pointer r = head->allocate();
-
-					// if this block doesnt have anymore space, move it to tail
-					// (alt. float up)
-					if(!head->hasroom() && head != tail) {
-						tail->next = head;
-						head->prev = tail;
-						tail = head;
-						head = head->next;
-						// tail and head are now updated
-						head->prev = tail->next = 0;
-					}
+					open = r->next;
+				if(r->next)
+					r->next->prev = r->prev;
+			}
 
-					return r;
-				}
-				else {
-					// allocate new head with space
-					block_block *block = new(_alloc(sizeof(*block))) block_block();
-					#ifdef __REPORT_ALLOCS__
-						std::cout << "block_list::allocate allocated new block @ " << (void*)block << std::endl << std::flush;
-					#endif
-					block->next = head;
-					head->prev = block;
-					head = block;
-					return head->allocate();
-				}
+			static run *&bucket(uintptr_t s) { return buckets[s & (nbuckets - 1)]; }
 
+			// the run of chunk p (under the lock)
+			static run *find(char *p) {
+				uintptr_t s = reinterpret_cast<uintptr_t>(p) / span;
+				for(int back = 0; back < 2; back++)
+					for(run *r = bucket(s - back); r; r = r->hnext)
+						if(size_t(p - r->base) < r->chunks * stride)
+							return r;
 				return 0;
 			}
+			// (false if there is no table to put it in)
+			static bool hash(run *r) {
+				if(nruns >= nbuckets)
+					rehash(nbuckets ? 2 * nbuckets : 16);
+				if(!nbuckets)
+					return false;
+				run *&b = bucket(reinterpret_cast<uintptr_t>(r->base) / span);
+				r->hnext = b;
+				b = r;
+				nruns++;
+				return true;
+			}
+			// (a table that cannot grow only makes the chains longer)
+			static void rehash(size_t n) {
+				run **b = static_cast<run**>(calloc(n, sizeof(run*)));
+				if(!b)
+					return;
+				for(size_t i = 0; i < nbuckets; i++)
+					while(run *r = buckets[i]) {
+						buckets[i] = r->hnext;
+						run *&to = b[(reinterpret_cast<uintptr_t>(r->base) / span) & (n - 1)];
+						r->hnext = to;
+						to = r;
+					}
+				free(buckets);
+				buckets = b;
+				nbuckets = n;
+			}
+			static void unhash(run *r) {
+				run **l = &bucket(reinterpret_cast<uintptr_t>(r->base) / span);
+				while(*l != r)
+					l = &(*l)->hnext;
+				*l = r->hnext;
+				nruns--;
+			}
 
-			/*
-				algo to deallocate goes like this:
-				find the block that contains p
-				b->deallocate()
-				if 'b' is empty and 'b' is not 'block',
-					remove it from the list and 'delete'
-				otherwise move to 'head'
-				(alt. approach is to 'float' 'b' towards 'head')
-			*/
-			void deallocate(pointer p) {
-				bool wasfull;
-				block_block *iter;
-				for(iter = head; iter != 0; iter = iter->next) {
-					if(iter->inblock(p))
-						break;
+			// a new run on the open list (under the lock)
+			static run *grow() {
+				size_t n = std::min(last ? 2 * last : 1, size_t(max_chunks));
+				run *r = static_cast<run*>(malloc(sizeof(run)));
+				void *m;
+				if(!r || posix_memalign(&m, align, (n - 1) * stride + size) != 0) {
+					free(r);
+					return 0;
 				}
-				// exceptionally throw from here (other functions just return 0)
-				if(!iter)
-					throw std::bad_alloc();
-
-				wasfull = !iter->hasroom();
-				iter->deallocate(p);
-				// if we just emptied this block, we can deallocate it
-				if(iter->isempty() && iter != &block) {
-					// detach (TODO: function)
-					if(iter->prev)
-						iter->prev->next = iter->next;
-					if(iter->next)
-						iter->next->prev = iter->prev;
-					if(iter == head)
-						head = iter->next;
-					if(iter == tail)
-						tail = iter->prev;
-
-					_free( iter );
-				}
-				else if(wasfull && iter != head) {
-					// move block back to head (alt. float downwards)
-					if(iter->prev)
-						iter->prev->next = iter->next;
-					if(iter->next)
-						iter->next->prev = iter->prev;
-					iter->next = head;
-					iter->prev = 0;
-					head->prev = iter;
-					head = iter;
+				r->base = static_cast<char*>(m);
+				if(!hash(r)) {
+					free(m);
+					free(r);
+					return 0;
 				}
+				last = n;
+				r->chunks = n;
+				r->carved = r->live = 0;
+				r->freed = 0;
+				reopen(r);
+				return r;
 			}
 		};
+	};
 
-		//===========================
+	template <size_t size, size_t align>
+	__spinlock malloc_chunks::provider<size, align>::lock;
+	template <size_t size, size_t align>
+	typename malloc_chunks::provider<size, align>::run *malloc_chunks::provider<size, align>::open = 0;
+	template <size_t size, size_t align>
+	typename malloc_chunks::provider<size, align>::run **malloc_chunks::provider<size, align>::buckets = 0;
+	template <size_t size, size_t align>
+	size_t malloc_chunks::provider<size, align>::nbuckets = 0;
+	template <size_t size, size_t align>
+	size_t malloc_chunks::provider<size, align>::nruns = 0;
+	template <size_t size, size_t align>
+	size_t malloc_chunks::provider<size, align>::last = 0;
+
+	/*
+		Chunks that divide the page (a whole page, or several to a page), kept
+		by page for the mmap'd chunk providers, so that a page whose chunks are all
+		released goes back to the system with MADV_DONTNEED. Regions of
+		RegionBytes (a power of two) are aligned to their size and start with
+		a header: the free chunks of each page as a bitmask, the pages that
+		have free chunks and the pages given back. Nothing is linked through
+		the chunks, so a page given back just reads as zero when it is used
+		again, and a new region is all given back pages, it is not touched
+		before it is used.
+
+		Pages with free chunks are used before those given back: the regions
+		that have them are at the front of the open list. All of it runs
+		under the lock of the provider.
+	*/
+	template <size_t Stride, size_t RegionBytes>
+	struct page_chunks {
+		// (the smallest page this is for, a region has at most max_pages)
+		static const size_t min_page = 4096;
+		static const size_t max_pages = RegionBytes / min_page;
+		static const size_t words = (max_pages + 63) / 64;
+
+		struct region {
+			region *next;		// on the open list, while it has free chunks
+			region *prev;
+			size_t free;		// chunks
+			size_t partial;		// pages with free chunks (not given back)
+			__uint64_t has_free[words];	// which those are
+			__uint64_t given_back[words];
+			__uint64_t chunks[max_pages];	// free chunks of each page with free chunks
+		};
 
+		region *open;		// regions with partial pages first
+		region *open_last;
 
-		block_allocator() throw() {
-			blocks = &blocks_static;
-		}
-		block_allocator(const block_allocator &other) throw() {
-			blocks = other.blocks;
-			blocks->refcount++;
+		static size_t page_size() {
+			static size_t page = size_t(sysconf(_SC_PAGESIZE));
+			return page;
 		}
-		template <class U, int __number_of_slots>
-		block_allocator(const block_allocator<U, __number_of_slots> &other) throw() {
-			/*
-				we can only use the blocks from the other allocator if its the
-				same templation type, any wa
-			*/
-			blocks = &blocks_static;
+		// pages the header takes
+		static size_t header_pages() { return (sizeof(region) + page_size() - 1) / page_size(); }
+		// false if the pages of this system do not hold whole chunks (or too many)
+		static bool usable() {
+			size_t page = page_size();
+			return Stride <= page && page % Stride == 0 && page / Stride <= 64
+				&& page >= min_page && RegionBytes / page > header_pages();
 		}
 
-		~block_allocator() throw() {
-			blocks->refcount--;
-			/*
-			if(blocks->refcount <= 0) {
-				blocks->~block_list();
-				_free( blocks );
+		// a free chunk, 0 if all regions are full (then add_region)
+		void *allocate() {
+			region *r = open;
+			if(!r)
+				return 0;
+			size_t page = page_size();
+			size_t pg;
+			if(r->partial)
+				pg = first(r->has_free);
+			else {
+				// (faulted in again when written)
+				pg = first(r->given_back);
+				clear(r->given_back, pg);
+				r->chunks[pg] = full();
+				set(r->has_free, pg);
+				r->partial++;
 			}
-			*/
-		};
-
-		pointer address(reference x) const
-		{ return &x; }
-		const_pointer address(const_reference x) const
-		{ return &x; }
+			__uint64_t &m = r->chunks[pg];
+			int c = __bitscan(m);
+			m &= m - 1;
+			r->free--;
+			if(!m) {
+				clear(r->has_free, pg);
+				if(!--r->partial) {
+					unlink(r);
+					if(r->free)
+						push_back(r);
+				}
+			}
+			return reinterpret_cast<char*>(r) + pg * page + c * Stride;
+		}
 
-		size_type max_size() const throw()
-		{ return 0x1; }
+		// give chunk p back, and its page once all of the page is free
+		void deallocate(void *p) {
+			size_t page = page_size();
+			region *r = reinterpret_cast<region*>(reinterpret_cast<uintptr_t>(p) & ~uintptr_t(RegionBytes - 1));
+			size_t off = size_t(static_cast<char*>(p) - reinterpret_cast<char*>(r));
+			size_t pg = off / page;
+			bool was_open = r->free != 0, was_partial = r->partial != 0;
+			__uint64_t &m = r->chunks[pg];
+			if(!m) {
+				set(r->has_free, pg);
+				r->partial++;
+			}
+			m |= __uint64_t(1) << (off % page / Stride);
+			r->free++;
+			if(m == full()) {
+				// (under the lock, nobody can take a chunk of it meanwhile)
+				madvise(reinterpret_cast<char*>(r) + pg * page, page, MADV_DONTNEED);
+				m = 0;
+				clear(r->has_free, pg);
+				r->partial--;
+				set(r->given_back, pg);
+			}
+			if(was_open && was_partial == (r->partial != 0))
+				return;
+			if(was_open)
+				unlink(r);
+			if(r->partial)
+				push_front(r);
+			else
+				push_back(r);
+		}
 
-		void construct(pointer p, const T& val)
-		{ new(p) T(val); }
-		void destroy(pointer p)
-		{ p->~T(); }
+		// a new region at 'base' (RegionBytes, aligned to that, zero filled)
+		void add_region(char *base) {
+			region *r = reinterpret_cast<region*>(base);
+			size_t pages = RegionBytes / page_size();
+			for(size_t pg = header_pages(); pg < pages; pg++)
+				set(r->given_back, pg);
+			r->free = (pages - header_pages()) * (page_size() / Stride);
+			push_back(r);
+		}
 
-		pointer allocate(size_type, typename block_allocator<void, _number_of_slots>::const_pointer hint = 0) {
-			pointer r = blocks->allocate();
-			if(!r)
-				throw std::bad_alloc();
-			return r;
+	private:
+		static __uint64_t full() {
+			size_t k = page_size() / Stride;
+			return k == 64 ? ~__uint64_t(0) : (__uint64_t(1) << k) - 1;
 		}
-		void deallocate(pointer p, size_type n) {
-			if(p)
-				blocks->deallocate(p);
+		static size_t first(const __uint64_t *bits) {
+			size_t i = 0;
+			while(!bits[i])
+				i++;
+			return i * 64 + __bitscan(bits[i]);
+		}
+		static void set(__uint64_t *bits, size_t i) { bits[i / 64] |= __uint64_t(1) << (i % 64); }
+		static void clear(__uint64_t *bits, size_t i) { bits[i / 64] &= ~(__uint64_t(1) << (i % 64)); }
+
+		void push_front(region *r) {
+			r->prev = 0;
+			r->next = open;
+			if(open)
+				open->prev = r;
+			else
+				open_last = r;
+			open = r;
+		}
+		void push_back(region *r) {
+			r->next = 0;
+			r->prev = open_last;
+			if(open_last)
+				open_last->next = r;
+			else
+				open = r;
+			open_last = r;
+		}
+		void unlink(region *r) {
+			if(r->prev)
+				r->prev->next = r->next;
+			else
+				open = r->next;
+			if(r->next)
+				r->next->prev = r->prev;
+			else
+				open_last = r->prev;
 		}
+	};
 
-	private:
-		friend class block_block;
-		friend class block_list;
+	/*
+		Blocks are carved from large mmap'd regions of RegionSize bytes (or one
+		block if that is bigger), so neighbouring blocks are neighbours in memory
+		too and there is no per block heap header. With HugePages the regions are
+		2MB aligned and advised MADV_HUGEPAGE, a list of tens of millions of
+		nodes then needs a fraction of the TLB entries.
+
+		Regions are never unmapped. Blocks that divide the page (page sized
+		ones included) are kept by page (see page_chunks), a page goes back
+		with MADV_DONTNEED once all of its blocks are released. Other released
+		chunks go to a free list of the provider and their whole pages (all but
+		the first, which holds the link) are given back, they read as zero when
+		touched again. So other blocks under two pages are never given back.
+	*/
+	template <size_t RegionSize = 2 * 1024 * 1024, bool HugePages = false>
+	struct mmap_chunks {
+		static const size_t huge_page_size = 2 * 1024 * 1024;
+
+		template <size_t size, size_t align> struct provider {
+			static const size_t region_align = HugePages && align < huge_page_size ? huge_page_size : align;
+			// chunks are carved 'stride' apart to keep each one aligned
+			static const size_t stride = (size + align - 1) & ~(align - 1);
+			static const size_t region_size = (RegionSize > stride ? RegionSize : stride) / stride * stride;
+			// regions for chunks kept by page, aligned to their size
+			typedef page_chunks<stride, __pow2_ceil<RegionSize>::value> pages;
+			static const size_t pages_align = RegionSize > region_align ? __pow2_ceil<RegionSize>::value : region_align;
+
+			static void *allocate() {
+				lock.lock();
+				void *p;
+				if(pages::usable()) {
+					p = grouped.allocate();
+					if(!p) {
+						char *m = static_cast<char*>(map(__pow2_ceil<RegionSize>::value, pages_align));
+						if(m) {
+							grouped.add_region(m);
+							p = grouped.allocate();
+						}
+					}
+				}
+				else if((p = freed))
+					freed = *static_cast<void**>(p);
+				else {
+					if(next == end) {
+						next = static_cast<char*>(map(region_size, region_align));
+						end = next ? next + region_size : 0;
+					}
+					if(next) {
+						p = next;
+						next += stride;
+					}
+				}
+				lock.unlock();
+				return p;
+			}
+			static void deallocate(void *p) {
+				if(pages::usable()) {
+					lock.lock();
+					grouped.deallocate(p);
+					lock.unlock();
+					return;
+				}
+				size_t page = page_size();
+				if(size >= 2 * page)
+					madvise(static_cast<char*>(p) + page, (size - page) & ~(page - 1), MADV_DONTNEED);
+				lock.lock();
+				*static_cast<void**>(p) = freed;
+				freed = p;
+				lock.unlock();
+			}
 
-		// to copy ctor or compare with private data, do this
-		template<typename U, int __number_of_slots>
-		friend class block_allocator;
+			static __spinlock lock;
+			static pages grouped;		// chunks that divide the page
+			static char *next;		// rest of the current region (other chunks)
+			static char *end;
+			static void *freed;		// released chunks, linked through their first word
+		};
 
-		block_list *blocks;
-		// static instantiation of blocks of same type
-		// TODO: find a way to instantiate blocks of same size
-		static block_list blocks_static;
+		static size_t page_size() {
+			static size_t page = size_t(sysconf(_SC_PAGESIZE));
+			return page;
+		}
 
-		static const int number_of_slots = _number_of_slots;
+		// map 'bytes' aligned to 'align' (over-map and cut off the ends)
+		static void *map(size_t bytes, size_t align) {
+			size_t page = page_size();
+			size_t extra = align > page ? align : 0;
+			void *m = mmap(0, bytes + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(m == MAP_FAILED)
+				return 0;
+			char *p = static_cast<char*>(m);
+			if(extra) {
+				char *a = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~uintptr_t(align - 1));
+				if(a != p)
+					munmap(p, a - p);
+				if(a + bytes != p + bytes + extra)
+					munmap(a + bytes, (p + bytes + extra) - (a + bytes));
+				p = a;
+			}
+#ifdef MADV_HUGEPAGE
+			if(HugePages)
+				madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+			return p;
+		}
 	};
 
-	// static instantiation of blocks of same type
-	template<typename T, int _number_of_slots>
-	typename block_allocator<T, _number_of_slots>::block_list
-		block_allocator<T, _number_of_slots>::blocks_static;
-
-	// then ofc these
-	template<typename T1, typename T2>
-	bool operator==(const block_allocator<T1> &a, const block_allocator<T2> &b) throw()
-	{ return a.blocks == b.blocks; }
-
-	template<typename T1, typename T2>
-	bool operator!=(const block_allocator<T1> &a, const block_allocator<T2> &b) throw()
-	{ return a.blocks != b.blocks; }
+	template <size_t RegionSize, bool HugePages> template <size_t size, size_t align>
+	__spinlock mmap_chunks<RegionSize, HugePages>::provider<size, align>::lock;
+	template <size_t RegionSize, bool HugePages> template <size_t size, size_t align>
+	typename mmap_chunks<RegionSize, HugePages>::template provider<size, align>::pages
+		mmap_chunks<RegionSize, HugePages>::provider<size, align>::grouped;
+	template <size_t RegionSize, bool HugePages> template <size_t size, size_t align>
+	char *mmap_chunks<RegionSize, HugePages>::provider<size, align>::next = 0;
+	template <size_t RegionSize, bool HugePages> template <size_t size, size_t align>
+	char *mmap_chunks<RegionSize, HugePages>::provider<size, align>::end = 0;
+	template <size_t RegionSize, bool HugePages> template <size_t size, size_t align>
+	void *mmap_chunks<RegionSize, HugePages>::provider<size, align>::freed = 0;
+
+	/*
+		mmap_chunks with regions of their own per NUMA node, for numa_local
+		lists. A list asks for a chunk of its node (allocate(node)) and gets
+		one from a region that was bound to that node as a whole when it was
+		mapped, so blocks of any size are placed, not just those spanning whole
+		pages. Released chunks go back to the regions of the node they are
+		released for, and their pages to the system like with mmap_chunks.
+		Node -1 (or past MaxNodes) is not bound.
+	*/
+	template <size_t RegionSize = 2 * 1024 * 1024, int MaxNodes = 8>
+	struct numa_chunks {
+		template <size_t size, size_t align> struct provider {
+			typedef mmap_chunks<RegionSize> mapper;
+			static const size_t stride = (size + align - 1) & ~(align - 1);
+			static const size_t region_size = (RegionSize > stride ? RegionSize : stride) / stride * stride;
+			typedef page_chunks<stride, __pow2_ceil<RegionSize>::value> pages;
+
+			static void *allocate(int node = -1) {
+				node_regions &r = regions[index(node)];
+				r.lock.lock();
+				void *p;
+				if(pages::usable()) {
+					p = r.grouped.allocate();
+					if(!p) {
+						const size_t bytes = __pow2_ceil<RegionSize>::value;
+						char *m = static_cast<char*>(mapper::map(bytes, bytes));
+						if(m) {
+							if(index(node) < MaxNodes)
+								numa_topology::bind(m, bytes, node);
+							r.grouped.add_region(m);
+							p = r.grouped.allocate();
+						}
+					}
+				}
+				else if((p = r.freed))
+					r.freed = *static_cast<void**>(p);
+				else {
+					if(r.next == r.end) {
+						r.next = static_cast<char*>(mapper::map(region_size, align));
+						r.end = r.next ? r.next + region_size : 0;
+						if(r.next && index(node) < MaxNodes)
+							numa_topology::bind(r.next, region_size, node);
+					}
+					if(r.next) {
+						p = r.next;
+						r.next += stride;
+					}
+				}
+				r.lock.unlock();
+				return p;
+			}
+			static void deallocate(void *p, int node = -1) {
+				node_regions &r = regions[index(node)];
+				if(pages::usable()) {
+					r.lock.lock();
+					r.grouped.deallocate(p);
+					r.lock.unlock();
+					return;
+				}
+				size_t page = mapper::page_size();
+				if(size >= 2 * page)
+					madvise(static_cast<char*>(p) + page, (size - page) & ~(page - 1), MADV_DONTNEED);
+				r.lock.lock();
+				*static_cast<void**>(p) = r.freed;
+				r.freed = p;
+				r.lock.unlock();
+			}
+
+			struct node_regions {
+				__spinlock lock;
+				pages grouped;		// chunks that divide the page
+				char *next;		// rest of the current region of the node (other chunks)
+				char *end;
+				void *freed;		// released chunks, linked through their first word
+			};
+			static node_regions regions[MaxNodes + 1];		// the last one is not bound
+
+			static int index(int node) { return node >= 0 && node < MaxNodes ? node : MaxNodes; }
+		};
+	};
+
+	template <size_t RegionSize, int MaxNodes> template <size_t size, size_t align>
+	typename numa_chunks<RegionSize, MaxNodes>::template provider<size, align>::node_regions
+		numa_chunks<RegionSize, MaxNodes>::provider<size, align>::regions[MaxNodes + 1];
+
+	// true for chunk policies whose providers take the node of the list
+	// (allocate(node), deallocate(p, node)), see numa_chunks
+	template <typename Chunks> struct chunks_per_node { static const bool value = false; };
+	template <size_t RegionSize, int MaxNodes>
+	struct chunks_per_node<numa_chunks<RegionSize, MaxNodes> > { static const bool value = true; };
+
+	// a chunk of Provider for a list of 'node' (-1 for none). providers that
+	// do not know about nodes get each chunk bound on its own, which covers
+	// only the whole pages in it
+	template <typename Provider, size_t Size, bool PerNode>
+	struct node_chunk {
+		static void *allocate(int node) {
+			void *p = Provider::allocate();
+			if(p && node >= 0)
+				numa_topology::bind(p, Size, node);
+			return p;
+		}
+		static void deallocate(void *p, int) { Provider::deallocate(p); }
+	};
+	template <typename Provider, size_t Size>
+	struct node_chunk<Provider, Size, true> {
+		static void *allocate(int node) { return Provider::allocate(node); }
+		static void deallocate(void *p, int node) { Provider::deallocate(p, node); }
+	};
+
+	// slots in use per block, see block_pool::occupancy
+	struct block_occupancy {
+		static const int buckets = 8;
+		size_t blocks;		// blocks in the list(s)
+		size_t sealed;		// of which sealed by compaction
+		size_t cached;		// empty blocks kept
+		size_t slots;		// slots in use
+		size_t capacity;	// slots in all those blocks
+		size_t histogram[buckets];	// blocks by used/capacity in 1/8 steps, full ones in the last
+	};
+
+	/*
+		Compaction state of all pools of a Policy, see compaction_scope.
+		'below' is the occupancy (percent) under which a block counts as sparse,
+		0 when nothing is being compacted. Blocks taken into use during a
+		compaction get the current 'epoch' and are never sealed by it.
+	*/
+	template <typename Policy> struct block_compaction {
+		static int below;
+		static unsigned epoch;
+	};
+	template <typename Policy> int block_compaction<Policy>::below = 0;
+	template <typename Policy> unsigned block_compaction<Policy>::epoch = 0;
+
+	// number of batch_scopes of a Policy alive
+	template <typename Policy> struct block_batching {
+		static int active;
+	};
+	template <typename Policy> int block_batching<Policy>::active = 0;
+
+	// placement hint of the calling thread for the next allocation with a Policy
+	// (see hint_scope)
+	template <typename Policy> struct block_hinting {
+		static const void *&near() { static __thread const void *p = 0; return p; }
+	};
+
+	/*
+		Layout policies, apply<size, align, slots> gives the slot size, slot
+		alignment and slots per block of a pool. Whatever the layout, the block
+		header (links and bitmap) has cache line(s) of its own.
+	*/
+
+	// slots back to back at the size of their class
+	struct packed_slots {
+		template <size_t Size, size_t Align, int Slots> struct apply {
+			static const size_t size = Size;
+			static const size_t align = Align;
+			static const int slots = Slots;
+		};
+	};
+
+	// every slot on cache line(s) of its own, for objects that different threads
+	// write to (no false sharing between neighbours, at the cost of the padding)
+	struct padded_slots {
+		template <size_t Size, size_t Align, int Slots> struct apply {
+			static const size_t align = Align > cache_line_size ? Align : cache_line_size;
+			static const size_t size = (Size + align - 1) & ~(align - 1);
+			static const int slots = Slots;
+		};
+	};
+
+	// as many slots as fit the power of two a block is aligned to anyway,
+	// and that at least MinBytes (a page by default). the space past the
+	// block up to its alignment is otherwise lost (mmap_chunks) or left to malloc.
+	// filled_blocks<0> keeps the span the asked slots need, the default layout
+	template <size_t MinBytes = 4096>
+	struct filled_blocks {
+		template <size_t Size, size_t Align, int Slots> struct apply {
+			static const size_t size = Size;
+			static const size_t align = Align;
+		private:
+			// header bytes of a block with n slots (see block_pool::block_block)
+			template <size_t n> struct header {
+				static const size_t line = Align > cache_line_size ? Align : cache_line_size;
+				static const size_t bitmask = sizeof(int_32_64::type);
+				static const size_t words = (n + bitmask * 8 - 1) / (bitmask * 8);
+				static const size_t value = (3 * sizeof(void*) + bitmask + 2 * sizeof(int) + words * bitmask + line - 1) & ~(line - 1);
+			};
+			static const size_t wanted = header<Slots>::value + Slots * Size;
+			static const size_t span = __pow2_ceil<(wanted > MinBytes ? wanted : MinBytes), sizeof(void*)>::value;
+		public:
+			static const int slots = int((span - header<span / Size>::value) / Size);
+		};
+	};
+
+	// what a pool's layout costs, see block_pool::layout_report
+	struct block_layout {
+		size_t object_size;		// sizeof(T) (0 when asked from the pool)
+		size_t slot_size;		// size class, padding included
+		size_t slot_align;
+		int slots;		// per block
+		size_t header_bytes;	// links and bitmap, with their padding
+		size_t block_bytes;		// a whole block
+		size_t block_span;		// what it is aligned to, its share of an mmap region
+		double bytes_per_object;	// block_span / slots
+	};
+
+	/*
+		Check policies. no_checks does nothing and compiles out entirely.
+
+		checked_slots, for chasing memory bugs without a sanitizer build:
+		- every slot gets a canary word after the object, checked when freed (overruns)
+		- free slots are poisoned, checked when allocated again (writes after free,
+		  the first word is not checked, remote frees link through it)
+		- double frees, pointers that are not a slot and pointers of another allocator
+		- live slots counted per T, a report of what is left at exit
+		Errors go to the handler (by default print and abort), if that returns
+		the free is skipped. The exit report runs after the destructors of all
+		globals, so slots they hold until exit are not reported.
+
+		Building with CUTEPIG_CHECKED makes it the default of block_policy.
+	*/
+	struct no_checks {
+		static const bool enabled = false;
+		static const size_t canary_bytes = 0;
+		static void fresh(void *, size_t) {}
+		static void allocated(void *, size_t) {}
+		static void freeing(void *, size_t) {}
+		static void fail(const char *, const void *) {}
+		template <typename T> static void live(int) {}
+	};
+
+	struct checked_slots {
+		static const bool enabled = true;
+		static const size_t canary_bytes = sizeof(uint64_t);
+		static const unsigned char poison = 0xdd;
+
+		typedef void (*handler)(const char *what, const void *p);
+		static handler &on_error() { static handler h = &abort_handler; return h; }
+		static void fail(const char *what, const void *p) { on_error()(what, p); }
+
+		// a new block, all slots free
+		static void fresh(void *p, size_t n) {
+			memset(p, poison, n);
+		}
+		// slot of 'size' (size class) taken into use
+		static void allocated(void *p, size_t size) {
+			unsigned char *c = static_cast<unsigned char*>(p);
+			size_t i = sizeof(void*);
+			while(i < size + canary_bytes && c[i] == poison)
+				i++;
+			// (the slot is handed out anyway, so it gets its canary first)
+			uint64_t canary = canary_of(p);
+			memcpy(c + size, &canary, sizeof(canary));
+			if(i < size + canary_bytes)
+				fail("write after free", p);
+		}
+		// slot given back
+		static void freeing(void *p, size_t size) {
+			unsigned char *c = static_cast<unsigned char*>(p);
+			uint64_t canary;
+			memcpy(&canary, c + size, sizeof(canary));
+			if(canary != canary_of(p))
+				fail("overrun past the end of the object", p);
+			memset(c, poison, size + canary_bytes);
+		}
+
+		// live slots of T
+		struct leak_entry {
+			const char *type;		// a __PRETTY_FUNCTION__ that names T
+			size_t size;
+			long live;
+			leak_entry *next;
+		};
+		template <typename T> static void live(int d) {
+			static leak_entry *e = enlist(type_name<T>(), sizeof(T));
+			__atomic_add_fetch(&e->live, d, __ATOMIC_RELAXED);
+		}
+
+		// slots still in use of all types, and a line per type to 'f'
+		static long report_leaks(FILE *f) {
+			long total = 0;
+			lock().lock();
+			for(leak_entry *e = entries(); e; e = e->next) {
+				long n = __atomic_load_n(&e->live, __ATOMIC_RELAXED);
+				if(!n)
+					continue;
+				total += n;
+				if(f) {
+					const char *t = strstr(e->type, "T = ");
+					fprintf(f, "cutepig: %ld live slots of %.*s (%lu bytes)\n", n,
+						t ? int(strcspn(t + 4, ";]")) : int(strlen(e->type)), t ? t + 4 : e->type,
+						(unsigned long)e->size);
+				}
+			}
+			lock().unlock();
+			return total;
+		}
+
+	private:
+		static void abort_handler(const char *what, const void *p) {
+			fprintf(stderr, "cutepig: %s (%p)\n", what, p);
+			abort();
+		}
+		// differs per slot so a slot copied over another is caught too
+		static uint64_t canary_of(const void *p) {
+			return uint64_t(reinterpret_cast<uintptr_t>(p)) ^ 0x5ca1ab1ec0ffee11ULL;
+		}
+
+		template <typename T> static const char *type_name() { return __PRETTY_FUNCTION__; }
+
+		static __spinlock &lock() { static __spinlock l; return l; }
+		static leak_entry *&entries() { static leak_entry *e = 0; return e; }
+		static leak_entry *enlist(const char *type, size_t size) {
+			leak_entry *e = static_cast<leak_entry*>(malloc(sizeof(leak_entry)));
+			if(!e)
+				abort();
+			e->type = type;
+			e->size = size;
+			e->live = 0;
+			lock().lock();
+			e->next = entries();
+			entries() = e;
+			lock().unlock();
+			return e;
+		}
+	};
+
+	// the checked_slots exit report, a destructor of the lowest priority runs after
+	// the atexit ones of globals (once, though every file including this has one)
+	inline void __checked_exit_report() __attribute__((destructor(101)));
+	inline void __checked_exit_report() {
+		static bool done = false;
+		if(!done) {
+			done = true;
+			checked_slots::report_leaks(stderr);
+		}
+	}
+
+	// bundle of policies for block_allocator,
+	// derive from this and override the ones you want to change
+	struct block_policy {
+		typedef single_thread threading;
+		typedef null_stats stats;
+		typedef retain_empty<> retention;
+		typedef malloc_chunks chunks;
+		typedef filled_blocks<0> layout;
+#ifdef CUTEPIG_CHECKED
+		typedef checked_slots checks;
+#else
+		typedef no_checks checks;
+#endif
+	};
+
+	struct concurrent_block_policy : block_policy {
+		typedef thread_cached threading;
+	};
+
+	struct numa_block_policy : block_policy {
+		typedef numa_local<> threading;
+		typedef numa_chunks<> chunks;
+	};
+
+	/*
+		Pool of blocks for one size class, shared by all block_allocators
+		whose objects fall into it (see block_size_class).
+
+		The pool keeps a shared list of blocks to allocate from.
+		Each block has number of slots to allocate from. Amount of slots is static,
+		while each block is dynamically allocated/free'd as necessary.
+
+		With thread_cached threading there is one list per thread instead,
+		see thread_list.
+	*/
+	template <size_t _slot_size, size_t _slot_align, int _number_of_slots, typename Policy>
+	struct block_pool {
+		typedef typename Policy::threading threading;
+		typedef typename Policy::stats stats;
+		typedef typename Policy::retention retention;
+		typedef typename Policy::checks checks;
+		// (room for the canary is part of the slot)
+		typedef typename Policy::layout::template apply<_slot_size + checks::canary_bytes, _slot_align, _number_of_slots> layout;
+
+		static const size_t slot_size = layout::size;
+		static const size_t slot_align = layout::align;
+		static const int number_of_slots = layout::slots;
+
+		// raw storage of one slot, nothing is constructed in there
+		struct slot { char bytes[slot_size]; } __attribute__((aligned(slot_align)));
+		typedef void *pointer;
+
+		struct block_list;
+
+		// invidual block
+		// blocks are allocated aligned to their own size (rounded up to power of two)
+		// so the owning block of any slot can be found by masking the pointer.
+		// the header (links and bitmap) has cache line(s) of its own and the slots
+		// start on the next one, making a block touches nothing but the header
+		struct block_block {
+			typedef int_32_64::type bitmask_t;
+			static const int bits = sizeof(bitmask_t) * 8;
+			static const int words = (number_of_slots + bits - 1) / bits;
+			block_block *prev;
+			block_block *next;
+			block_list *owner;
+			bitmask_t used;		// number of allocated slots (bitmask_t for padding)
+			unsigned epoch;		// compaction epoch it was taken into use in
+			int sealed;		// no allocations from it until unsealed, see block_list::seal
+			bitmask_t slots[words];
+			slot ptr[number_of_slots] __attribute__((aligned(cache_line_size)));
+
+			// very simple constructor
+			block_block(block_list *o) {
+				prev = next = 0;
+				owner = o;
+				used = 0;
+				epoch = 0;
+				sealed = 0;
+				for(int w = 0; w < words; w++)
+					slots[w] = 0;
+				// mark the bits past the last slot as taken so the scan never finds them
+				if(number_of_slots % bits)
+					slots[words - 1] = ~bitmask_t(0) << (number_of_slots % bits);
+				if(checks::enabled)
+					checks::fresh(ptr, sizeof(ptr));
+			}
+
+			// returns true if this block has slots available
+			bool hasroom() { return used < bitmask_t(number_of_slots); }
+			// returns true if block is all empty
+			bool isempty() { return (used == 0); }
+
+			// allocate a slot (excepts that the block has been checked with hasroom)
+			pointer allocate() {
+				// first word with a free bit, then lowest free bit in it
+				for(int w = 0; w < words; w++) {
+					bitmask_t avail = ~slots[w];
+					if(avail) {
+						int i = __bitscan(avail);
+						// mark allocated
+						slots[w] |= bitmask_t(1) << i;
+						used++;
+						checks::allocated(&ptr[w * bits + i], _slot_size);
+						return &ptr[w * bits + i];
+					}
+				}
+				return 0;
+			}
+
+			// allocate the free slot nearest to slot i, the first one after it or else
+			// the last one before it (excepts that the block has room)
+			pointer allocate_near(int i) {
+				int w = i / bits;
+				bitmask_t avail = ~slots[w] & (~bitmask_t(0) << (i % bits));
+				for(int v = w + 1; !avail && v < words; v++)
+					avail = ~slots[w = v];
+				if(avail)
+					i = __bitscan(avail);
+				else {
+					for(w = i / bits; !(avail = ~slots[w]); w--)
+						;
+					i = int(sizeof(bitmask_t) * 8) - 1 - (sizeof(bitmask_t) == 8 ?
+						__builtin_clzll(avail) : __builtin_clz(avail));
+				}
+				slots[w] |= bitmask_t(1) << i;
+				used++;
+				checks::allocated(&ptr[w * bits + i], _slot_size);
+				return &ptr[w * bits + i];
+			}
+
+			// allocate up to n slots into out, returns how many
+			template <typename P>
+			size_t allocate_batch(P *out, size_t n) {
+				size_t got = 0;
+				for(int w = 0; w < words && got < n; w++) {
+					bitmask_t avail = ~slots[w];
+					while(avail && got < n) {
+						int i = __bitscan(avail);
+						avail &= avail - 1;
+						slots[w] |= bitmask_t(1) << i;
+						checks::allocated(&ptr[w * bits + i], _slot_size);
+						out[got++] = static_cast<P>(static_cast<void*>(&ptr[w * bits + i]));
+					}
+				}
+				used += bitmask_t(got);
+				return got;
+			}
+
+			// claim all free slots of the first word that has any (the block must have room),
+			// returns the word, the slots are the bits of 'mask'
+			int claim(bitmask_t &mask) {
+				for(int w = 0; w < words; w++) {
+					bitmask_t avail = ~slots[w];
+					if(avail) {
+						slots[w] = ~bitmask_t(0);
+						used += bitmask_t(__builtin_popcountll(avail));
+						mask = avail;
+						return w;
+					}
+				}
+				mask = 0;
+				return 0;
+			}
+
+			// deallocate a slot
+			void deallocate(pointer p) {
+				bitmask_t i = bitmask_t(static_cast<slot*>(p) - ptr);
+				if(checks::enabled) {
+					if((static_cast<char*>(p) - reinterpret_cast<char*>(ptr)) % sizeof(slot)) {
+						checks::fail("pointer is not a slot", p);
+						return;
+					}
+					if(!(slots[i / bits] & (bitmask_t(1) << (i % bits)))) {
+						checks::fail("double free", p);
+						return;
+					}
+					checks::freeing(p, _slot_size);
+				}
+				slots[i / bits] &= ~(bitmask_t(1) << (i % bits));
+				used--;
+			}
+
+			// tell me if given pointer is inside this block
+			bool inblock(pointer p) {
+				return (static_cast<slot*>(p) >= ptr && static_cast<slot*>(p) < &(ptr[number_of_slots]));
+			}
+		};
+
+		// container of blocks (the shared one, one per thread or node, or one in a block_heap)
+		struct block_list {
+			block_block *head;
+			block_block *tail;
+			block_block *cached;		// empty blocks kept for reuse, linked through next
+			block_block *sealed;		// sparse blocks set aside by compaction
+			int ncached;
+			int node;		// NUMA node the blocks are bound to, -1 if none
+			void *remote;		// slots freed by other threads, linked through the slots
+			block_list *abandoned;		// link in the list of lists of exited threads
+			block_block *stash_block;		// slots claimed a word at a time in a batch_scope
+			typename block_block::bitmask_t stash;
+			int stash_word;
+
+			// every block is aligned to its size rounded up to power of two
+			static const size_t block_alignment = __pow2_ceil<sizeof(block_block), sizeof(void*)>::value;
+
+			block_list()
+				: head(0), tail(0), cached(0), sealed(0), ncached(0), node(-1), remote(0), abandoned(0),
+				  stash_block(0), stash(0), stash_word(0)
+			{}
+
+			// find the block that would contain p (just a mask, p is not checked)
+			static block_block *blockof(pointer p) {
+				return reinterpret_cast<block_block*>(
+					reinterpret_cast<uintptr_t>(p) & ~uintptr_t(block_alignment - 1));
+			}
+
+			// where blocks come from (aligned to block_alignment, see blockof)
+			typedef typename Policy::chunks::template provider<sizeof(block_block), block_alignment> chunks;
+
+			typedef node_chunk<chunks, sizeof(block_block), chunks_per_node<typename Policy::chunks>::value> node_chunks;
+
+			// internal system allocation functions, for the node of this list
+			void *_alloc( size_t ) {
+				return node_chunks::allocate(node);
+			}
+			void _free( void *p ) {
+				node_chunks::deallocate(p, node);
+			}
+
+			/*
+				so, algorithm goes like this:
+				if 'head' has no slots available
+					take a cached empty block or allocate new one, make it 'head'
+				r = head->allocate();
+				if 'head' has no slots available and 'head' != 'tail'
+					move 'head' to 'tail'
+				(in a batch_scope a whole bitmap word of 'head' is claimed at once
+				and handed out from 'stash' until it runs out)
+			*/
+			pointer allocate() {
+				if(stash)
+					return unstash();
+
+				// while compacting, sparse old blocks are set aside
+				if(__atomic_load_n(&block_compaction<Policy>::below, __ATOMIC_RELAXED))
+					seal_sparse();
+
+				// blocks with free space are always in the beginning
+				if((!head || !head->hasroom()) && !grow())
+					return 0;
+
+				if(__atomic_load_n(&block_batching<Policy>::active, __ATOMIC_RELAXED)) {
+					stash_block = head;
+					stash_word = head->claim(stash);
+					fullhead();
+					return unstash();
+				}
+
+				pointer r = head->allocate();
+				fullhead();
+				return r;
+			}
+
+			/*
+				allocate next to 'near' (any address inside a slot of this pool):
+				from the block of 'near' if it has room, else from the blocks next
+				to it in the list (they were allocated around the same time),
+				else as usual. so a node goes to the cache lines and pages of
+				the node it is linked to, even after churn scattered the free
+				slots. a near that is not in a block of this list is ignored
+				(like in deallocate, the masked address has to be readable).
+				not while batching or compacting, they decide placement there.
+			*/
+			pointer allocate(const void *near) {
+				if(!near || stash || __atomic_load_n(&block_compaction<Policy>::below, __ATOMIC_RELAXED))
+					return allocate();
+				pointer p = const_cast<pointer>(near);
+				block_block *block = blockof(p);
+				if(block->owner != this || block->sealed || !block->inblock(p))
+					return allocate();
+				int i = int(size_t(static_cast<char*>(p) - reinterpret_cast<char*>(block->ptr)) / sizeof(slot));
+				if(!block->hasroom()) {
+					if(block->prev && block->prev->hasroom())
+						block = block->prev, i = number_of_slots - 1;
+					else if(block->next && block->next->hasroom())
+						block = block->next, i = 0;
+					else
+						return allocate();
+				}
+				pointer r = block->allocate_near(i);
+				// full blocks go to the tail (head is never a full block after this)
+				if(!block->hasroom() && block != tail) {
+					detach(block);
+					push_back(block);
+				}
+				return r;
+			}
+
+			// allocate up to n slots into out, returns how many (less only if out of memory)
+			template <typename P>
+			size_t allocate_batch(P *out, size_t n) {
+				size_t got = 0;
+				if(__atomic_load_n(&block_compaction<Policy>::below, __ATOMIC_RELAXED))
+					seal_sparse();
+				while(got < n) {
+					if((!head || !head->hasroom()) && !grow())
+						break;
+					got += head->allocate_batch(out + got, n - got);
+					fullhead();
+				}
+				return got;
+			}
+
+			// make 'head' a block with room, false if out of memory
+			bool grow() {
+				// before growing, take back what other threads have freed
+				if(threading::concurrent && __atomic_load_n(&remote, __ATOMIC_RELAXED))
+					collect();
+				// and the sealed blocks once compaction is over
+				if((!head || !head->hasroom()) && sealed
+					&& !__atomic_load_n(&block_compaction<Policy>::below, __ATOMIC_RELAXED))
+					unseal();
+				if(!head || !head->hasroom()) {
+					block_block *block = uncache();
+					if(!block)
+						return false;
+					block->epoch = __atomic_load_n(&block_compaction<Policy>::epoch, __ATOMIC_RELAXED);
+					push_front(block);
+				}
+				return true;
+			}
+
+			// if 'head' doesnt have anymore space, move it to tail
+			void fullhead() {
+				if(!head->hasroom() && head != tail) {
+					block_block *full = head;
+					detach(full);
+					push_back(full);
+				}
+			}
+
+			// next stashed slot
+			pointer unstash() {
+				int i = __bitscan(stash);
+				stash &= stash - 1;
+				pointer r = &stash_block->ptr[stash_word * block_block::bits + i];
+				checks::allocated(r, _slot_size);
+				return r;
+			}
+			// give back the slots left in the stash
+			void flush() {
+				while(stash)
+					deallocate(unstash());
+			}
+
+			/*
+				algo to deallocate goes like this:
+				find the block that contains p (mask the pointer, see blockof)
+				b->deallocate()
+				if 'b' is empty, remove it from the list and cache it
+				if 'b' was full, move it to 'head' (its the fullest one now)
+				otherwise with most_full_first, 'float' 'b' towards 'tail'
+				past blocks that have more slots in use
+			*/
+			void deallocate(pointer p) {
+				block_block *iter = blockof(p);
+				// exceptionally throw from here (other functions just return 0)
+				// NOTE: a pointer that never came from a block allocator is only
+				// caught as long as the masked address is readable
+				if(iter->owner != this || !iter->inblock(p)) {
+					checks::fail(iter->owner != this ? "pointer of another allocator" : "pointer outside of its block", p);
+					throw std::bad_alloc();
+				}
+
+				bool wasfull = !iter->hasroom();
+				iter->deallocate(p);
+				freed(iter, wasfull);
+			}
+
+			// free n slots, runs of slots in the same block are freed together
+			// and the block is moved in the list once per run
+			template <typename P>
+			void deallocate_batch(P *p, size_t n) {
+				size_t i = 0;
+				while(i < n) {
+					block_block *iter = blockof(p[i]);
+					if(iter->owner != this) {
+						checks::fail("pointer of another allocator", p[i]);
+						throw std::bad_alloc();
+					}
+					bool wasfull = !iter->hasroom();
+					do {
+						if(!iter->inblock(p[i])) {
+							checks::fail("pointer outside of its block", p[i]);
+							freed(iter, wasfull);
+							throw std::bad_alloc();
+						}
+						iter->deallocate(p[i]);
+						i++;
+					} while(i < n && blockof(p[i]) == iter);
+					freed(iter, wasfull);
+				}
+			}
+
+			// move a block that slots were freed from to where it belongs
+			void freed(block_block *iter, bool wasfull) {
+				if(iter->sealed) {
+					if(iter->isempty()) {
+						unlink_sealed(iter);
+						cache(iter);
+					}
+					return;
+				}
+				if(iter->isempty()) {
+					detach(iter);
+					cache(iter);
+				}
+				else if(wasfull) {
+					if(iter != head) {
+						detach(iter);
+						push_front(iter);
+					}
+				}
+				else if(retention::most_full_first)
+					sink(iter);
+			}
+
+			// free cached empty blocks, keep at most 'keep' of them
+			// (the slots left in the stash are given back first)
+			void trim(int keep = 0) {
+				flush();
+				while(ncached > keep) {
+					block_block *block = cached;
+					cached = block->next;
+					ncached--;
+					_free( block );
+					stats::block_freed(sizeof(block_block));
+				}
+			}
+
+			// list handling
+			void detach(block_block *block) {
+				if(block->prev)
+					block->prev->next = block->next;
+				if(block->next)
+					block->next->prev = block->prev;
+				if(block == head)
+					head = block->next;
+				if(block == tail)
+					tail = block->prev;
+				block->prev = block->next = 0;
+			}
+			void push_front(block_block *block) {
+				block->prev = 0;
+				block->next = head;
+				if(head)
+					head->prev = block;
+				else
+					tail = block;
+				head = block;
+			}
+			void push_back(block_block *block) {
+				block->next = 0;
+				block->prev = tail;
+				if(tail)
+					tail->next = block;
+				else
+					head = block;
+				tail = block;
+			}
+
+			// swap a block one step towards tail if the next one is fuller
+			// (one step per call, keeps partial blocks roughly most full first)
+			void sink(block_block *block) {
+				block_block *next = block->next;
+				if(!next || !next->hasroom() || next->used <= block->used)
+					return;
+				detach(block);
+				block->prev = next;
+				block->next = next->next;
+				if(next->next)
+					next->next->prev = block;
+				else
+					tail = block;
+				next->next = block;
+			}
+
+			/*
+				compaction: a sealed block is out of the list (in 'sealed', linked
+				through prev/next), it is only freed to. when it gets empty it is
+				cached as usual, otherwise it goes back to the list the next time
+				the list would grow outside of a compaction
+			*/
+			void seal(block_block *block) {
+				detach(block);
+				block->sealed = 1;
+				block->next = sealed;
+				if(sealed)
+					sealed->prev = block;
+				sealed = block;
+			}
+			void unlink_sealed(block_block *block) {
+				if(block->prev)
+					block->prev->next = block->next;
+				else
+					sealed = block->next;
+				if(block->next)
+					block->next->prev = block->prev;
+				block->prev = block->next = 0;
+				block->sealed = 0;
+			}
+			void unseal() {
+				while(sealed) {
+					block_block *block = sealed;
+					unlink_sealed(block);
+					push_front(block);
+				}
+			}
+			// seal the sparse blocks at the head that are older than this compaction
+			// (partial blocks are most full first, so the sparse ones come up last)
+			void seal_sparse() {
+				unsigned epoch = __atomic_load_n(&block_compaction<Policy>::epoch, __ATOMIC_RELAXED);
+				int below = __atomic_load_n(&block_compaction<Policy>::below, __ATOMIC_RELAXED);
+				while(head && head->hasroom() && head->epoch != epoch
+					&& head->used * 100 < typename block_block::bitmask_t(below) * number_of_slots)
+					seal(head);
+			}
+
+			// add what this list holds to 'o'
+			void occupancy(block_occupancy &o) {
+				block_block *b;
+				flush();
+				for(int pass = 0; pass < 2; pass++) {
+					for(b = pass ? sealed : head; b; b = b->next) {
+						o.blocks++;
+						o.sealed += pass;
+						o.slots += b->used;
+						o.capacity += number_of_slots;
+						int i = int(b->used * block_occupancy::buckets / number_of_slots);
+						o.histogram[i < block_occupancy::buckets ? i : block_occupancy::buckets - 1]++;
+					}
+				}
+				o.cached += ncached;
+			}
+
+			// keep an empty block, or free them down to retention::low
+			// if there are more than retention::high
+			void cache(block_block *block) {
+				block->next = cached;
+				cached = block;
+				ncached++;
+				if(ncached > retention::high)
+					trim(retention::low);
+			}
+			// empty block from the cache or a new one
+			block_block *uncache() {
+				block_block *block = cached;
+				if(block) {
+					cached = block->next;
+					ncached--;
+					block->next = 0;
+					return block;
+				}
+				void *mem = _alloc(sizeof(block_block));
+				if(!mem)
+					return 0;
+				block = new(mem) block_block(this);
+				stats::block_allocated(sizeof(block_block));
+				return block;
+			}
+
+			// hand a slot back to this list from another thread (lock-free push)
+			void remote_free(pointer p) {
+				// (the slots are linked together, a size class always fits a pointer)
+				if(!blockof(p)->inblock(p))
+					throw std::bad_alloc();
+				void *old = __atomic_load_n(&remote, __ATOMIC_RELAXED);
+				do {
+					*reinterpret_cast<void**>(p) = old;
+				} while(!__atomic_compare_exchange_n(&remote, &old, p,
+					true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+			}
+
+			// take all remotely freed slots at once and free them locally
+			// (only the owning thread pops, so there is no ABA problem)
+			void collect() {
+				void *r = __atomic_exchange_n(&remote, (void*)0, __ATOMIC_ACQUIRE);
+				void *twice = checks::enabled ? uncycle(r) : 0;
+				while(r) {
+					void *next = link(r);
+					deallocate(r);
+					r = next;
+				}
+				if(twice)
+					checks::fail("double free", twice);
+			}
+
+			// a slot freed twice through the queue links it into a cycle, cut the
+			// chain where it comes around and return the slot (0 if no cycle).
+			// nothing is freed yet, so the links of the whole chain can be read
+			static void *uncycle(void *r) {
+				// Brent's cycle detection, n is the length of the cycle
+				void *slow = r, *fast = r ? link(r) : 0;
+				size_t power = 1, n = 1;
+				while(fast && fast != slow) {
+					if(power == n) {
+						slow = fast;
+						power *= 2;
+						n = 0;
+					}
+					fast = link(fast);
+					n++;
+				}
+				if(!fast)
+					return 0;
+				// one n ahead of the other, they meet at the first slot of the cycle
+				void *a = r, *b = r, *last = 0;
+				for(size_t i = 0; i < n; i++)
+					last = b, b = link(b);
+				while(a != b)
+					a = link(a), last = b, b = link(b);
+				link(last) = 0;
+				return a;
+			}
+			static void *&link(void *p) { return *reinterpret_cast<void**>(p); }
+
+			// true if no slot in this list is in use (empty blocks are never in the list)
+			bool isempty() {
+				return !head && !sealed;
+			}
+
+			// free all blocks (all slots must be free)
+			void release() {
+				while(head) {
+					block_block *next = head->next;
+					_free( head );
+					stats::block_freed(sizeof(block_block));
+					head = next;
+				}
+				tail = 0;
+				while(sealed) {
+					block_block *next = sealed->next;
+					_free( sealed );
+					stats::block_freed(sizeof(block_block));
+					sealed = next;
+				}
+				stash = 0;
+				trim();
+			}
+		};
+
+		//===========================
+
+		// static instantiation of blocks of same size
+		static block_list blocks_static;
+
+		// allocate a slot from the shared list, or the list of the calling thread
+		// (or the list of its node)
+		static void *allocate() {
+			if(threading::nodes) {
+				node_list &n = node_lists[current_node()];
+				n.lock.lock();
+				void *r = n.list.allocate();
+				n.lock.unlock();
+				return r;
+			}
+			block_list *l = threading::concurrent ? thread_list() : &blocks_static;
+			return l ? l->allocate() : 0;
+		}
+		// same, next to 'near' if possible (see block_list::allocate)
+		static void *allocate(const void *near) {
+			if(threading::nodes) {
+				node_list &n = node_lists[current_node()];
+				n.lock.lock();
+				void *r = n.list.allocate(near);
+				n.lock.unlock();
+				return r;
+			}
+			block_list *l = threading::concurrent ? thread_list() : &blocks_static;
+			return l ? l->allocate(near) : 0;
+		}
+
+		// give a slot back to the list that owns its block
+		// (from another thread it goes through the remote queue)
+		static void deallocate(void *p) {
+			if(!threading::concurrent) {
+				blocks_static.deallocate(p);
+				return;
+			}
+			block_list *owner = block_list::blockof(p)->owner;
+			if(threading::nodes) {
+				// a foreign pointer has no node list to lock, the list throws
+				node_list &n = node_lists[owner->node >= 0 && owner->node < nlists ? owner->node : 0];
+				n.lock.lock();
+				try {
+					owner->deallocate(p);
+				} catch(...) {
+					n.lock.unlock();
+					throw;
+				}
+				n.lock.unlock();
+				return;
+			}
+			if(owner == thread_blocks)
+				owner->deallocate(p);
+			else
+				owner->remote_free(p);
+		}
+
+		// up to n slots at once into out, returns how many
+		template <typename P>
+		static size_t allocate_batch(P *out, size_t n) {
+			if(threading::nodes) {
+				node_list &nl = node_lists[current_node()];
+				nl.lock.lock();
+				size_t r = nl.list.allocate_batch(out, n);
+				nl.lock.unlock();
+				return r;
+			}
+			block_list *l = threading::concurrent ? thread_list() : &blocks_static;
+			return l ? l->allocate_batch(out, n) : 0;
+		}
+
+		// free n slots, runs of slots of the same list go together
+		template <typename P>
+		static void deallocate_batch(P *p, size_t n) {
+			if(!threading::concurrent) {
+				blocks_static.deallocate_batch(p, n);
+				return;
+			}
+			size_t i = 0, j;
+			while(i < n) {
+				block_list *owner = block_list::blockof(p[i])->owner;
+				for(j = i + 1; j < n && block_list::blockof(p[j])->owner == owner; j++)
+					;
+				if(threading::nodes) {
+					node_list &nl = node_lists[owner->node >= 0 && owner->node < nlists ? owner->node : 0];
+					nl.lock.lock();
+					try {
+						owner->deallocate_batch(p + i, j - i);
+					} catch(...) {
+						nl.lock.unlock();
+						throw;
+					}
+					nl.lock.unlock();
+				}
+				else if(owner == thread_blocks)
+					owner->deallocate_batch(p + i, j - i);
+				else {
+					for(; i < j; i++)
+						owner->remote_free(p[i]);
+				}
+				i = j;
+			}
+		}
+
+		// free the cached empty blocks of the shared list (or the list of the calling thread
+		// and the lists of exited threads, or all node lists)
+		static void trim(int keep = 0) {
+			if(threading::nodes) {
+				for(int i = 0; i < nlists; i++) {
+					node_lists[i].lock.lock();
+					node_lists[i].list.trim(keep);
+					node_lists[i].lock.unlock();
+				}
+				return;
+			}
+			block_list *l = threading::concurrent ? thread_blocks : &blocks_static;
+			if(l)
+				l->trim(keep);
+			if(threading::concurrent)
+				drain_abandoned();
+		}
+
+		// per-node lists (numa_local threading only)
+
+		static const int nlists = threading::nodes ? threading::nodes : 1;
+		struct node_list {
+			__spinlock lock;
+			block_list list;
+			node_list() : lock() { list.node = int(this - node_lists); }
+		} __attribute__((aligned(cache_line_size)));
+		static node_list node_lists[nlists];
+
+		// list index of the calling thread (nodes past nlists share lists)
+		static int current_node() {
+			return numa_topology::current_node() % nlists;
+		}
+
+		// slots used per block, of the shared list (or the list of the calling thread,
+		// or all node lists)
+		static block_occupancy occupancy() {
+			block_occupancy o = block_occupancy();
+			if(threading::nodes) {
+				for(int i = 0; i < nlists; i++) {
+					node_lists[i].lock.lock();
+					node_lists[i].list.occupancy(o);
+					node_lists[i].lock.unlock();
+				}
+				return o;
+			}
+			block_list *l = threading::concurrent ? thread_blocks : &blocks_static;
+			if(l)
+				l->occupancy(o);
+			return o;
+		}
+
+		// what the list of 'node' holds right now
+		static numa_usage usage(int node) {
+			numa_usage u = { 0, 0, 0 };
+			if(node < 0 || node >= nlists)
+				return u;
+			node_list &n = node_lists[node];
+			n.lock.lock();
+			for(block_block *b = n.list.head; b; b = b->next) {
+				u.blocks++;
+				u.slots += b->used;
+			}
+			u.cached = n.list.ncached;
+			n.lock.unlock();
+			return u;
+		}
+
+		// per-thread lists (thread_cached threading only)
+
+		static __thread block_list *thread_blocks;
+		// lists of exited threads that still have slots in use
+		static block_list *abandoned_lists;
+		static __spinlock abandoned_lock;
+
+		// list of the calling thread, adopt an abandoned one or make a new one
+		static block_list *thread_list() {
+			block_list *l = thread_blocks;
+			if(l)
+				return l;
+
+			// registers thread_exit for this thread
+			static pthread_key_t key = thread_key();
+
+			abandoned_lock.lock();
+			l = abandoned_lists;
+			if(l) {
+				abandoned_lists = l->abandoned;
+				l->abandoned = 0;
+			}
+			abandoned_lock.unlock();
+
+			if(!l) {
+				void *mem = malloc(sizeof(block_list));
+				if(!mem)
+					return 0;
+				l = new(mem) block_list();
+			}
+			thread_blocks = l;
+			pthread_setspecific(key, l);
+			return l;
+		}
+
+		static pthread_key_t thread_key() {
+			pthread_key_t key;
+			pthread_key_create(&key, &thread_exit);
+			return key;
+		}
+
+		// a thread is going away: free its list if nothing is in use anymore,
+		// otherwise leave it for the next thread (remote frees still land in it,
+		// trim() takes them back)
+		static void thread_exit(void *p) {
+			block_list *l = static_cast<block_list*>(p);
+			thread_blocks = 0;
+			l->collect();
+			l->flush();
+			if(retire(l))
+				return;
+			// nobody allocates from a parked list, its cache is of no use
+			l->trim();
+			abandoned_lock.lock();
+			l->abandoned = abandoned_lists;
+			abandoned_lists = l;
+			abandoned_lock.unlock();
+		}
+
+		// free the parked lists that other threads have freed everything of
+		// since, and the blocks they emptied in the others
+		static void drain_abandoned() {
+			abandoned_lock.lock();
+			// (holding the lock makes us the owner of the parked lists)
+			block_list **a = &abandoned_lists;
+			while(block_list *l = *a) {
+				l->collect();
+				block_list *next = l->abandoned;
+				if(retire(l))
+					*a = next;
+				else {
+					l->trim();
+					a = &l->abandoned;
+				}
+			}
+			abandoned_lock.unlock();
+		}
+
+		// free list l if nothing in it is in use anymore
+		static bool retire(block_list *l) {
+			if(!l->isempty())
+				return false;
+			l->release();
+			l->~block_list();
+			free(l);
+			return true;
+		}
+
+		// the layout of this pool, see block_layout
+		static block_layout layout_report() {
+			block_layout l;
+			l.object_size = 0;
+			l.slot_size = slot_size;
+			l.slot_align = slot_align;
+			l.slots = number_of_slots;
+			l.block_bytes = sizeof(block_block);
+			l.header_bytes = sizeof(block_block) - number_of_slots * sizeof(slot);
+			l.block_span = block_list::block_alignment;
+			l.bytes_per_object = double(l.block_span) / number_of_slots;
+			return l;
+		}
+	};
+
+	// static instantiation of blocks of same size
+	template <size_t _slot_size, size_t _slot_align, int _number_of_slots, typename Policy>
+	typename block_pool<_slot_size, _slot_align, _number_of_slots, Policy>::block_list
+		block_pool<_slot_size, _slot_align, _number_of_slots, Policy>::blocks_static;
+
+	template <size_t _slot_size, size_t _slot_align, int _number_of_slots, typename Policy>
+	typename block_pool<_slot_size, _slot_align, _number_of_slots, Policy>::node_list
+		block_pool<_slot_size, _slot_align, _number_of_slots, Policy>::node_lists[nlists];
+
+	template <size_t _slot_size, size_t _slot_align, int _number_of_slots, typename Policy>
+	__thread typename block_pool<_slot_size, _slot_align, _number_of_slots, Policy>::block_list *
+		block_pool<_slot_size, _slot_align, _number_of_slots, Policy>::thread_blocks = 0;
+
+	template <size_t _slot_size, size_t _slot_align, int _number_of_slots, typename Policy>
+	typename block_pool<_slot_size, _slot_align, _number_of_slots, Policy>::block_list *
+		block_pool<_slot_size, _slot_align, _number_of_slots, Policy>::abandoned_lists = 0;
+
+	template <size_t _slot_size, size_t _slot_align, int _number_of_slots, typename Policy>
+	__spinlock block_pool<_slot_size, _slot_align, _number_of_slots, Policy>::abandoned_lock;
+
+	/*
+		Private pools, one list per size class that is used through it. A
+		block_allocator made from a heap (and all its copies and rebinds)
+		allocates from these lists instead of the shared pools, so containers
+		on different heaps never share blocks.
+
+		A heap is not synchronized, use it from one thread at a time (whatever
+		the threading policy says). Refcounted by the allocators using it:
+		create() makes one that deletes itself when the last allocator goes,
+		one on the stack or a member must outlive its containers.
+		Either way all its blocks are freed at once, O(blocks), at the end.
+	*/
+	template <typename Policy = block_policy>
+	class block_heap {
+	public:
+		block_heap() throw()
+			: refs(0), owned(false), nlists(0)
+		{}
+		~block_heap() throw() { release(); }
+
+		// a heap owned by the allocators, make one from it right away
+		// (it is gone when the last allocator using it is)
+		static block_heap *create() {
+			void *mem = malloc(sizeof(block_heap));
+			if(!mem)
+				throw std::bad_alloc();
+			block_heap *h = new(mem) block_heap();
+			h->owned = true;
+			return h;
+		}
+
+		void ref() throw() { __sync_add_and_fetch(&refs, 1); }
+		void unref() throw() {
+			if(__sync_sub_and_fetch(&refs, 1) == 0 && owned) {
+				this->~block_heap();
+				free(this);
+			}
+		}
+
+		// the list of Pool in this heap, made on first use (0 if out of room or memory)
+		template <typename Pool>
+		typename Pool::block_list *list() throw() {
+			// the shared list of a pool is as good a key as any
+			const void *key = &Pool::blocks_static;
+			int i;
+			for(i = 0; i < nlists; i++) {
+				if(lists[i].key == key)
+					return static_cast<typename Pool::block_list*>(lists[i].list);
+			}
+			if(nlists == max_lists)
+				return 0;
+			void *mem = malloc(sizeof(typename Pool::block_list));
+			if(!mem)
+				return 0;
+			lists[nlists].key = key;
+			lists[nlists].list = new(mem) typename Pool::block_list();
+			lists[nlists].destroy = &destroy<Pool>;
+			return static_cast<typename Pool::block_list*>(lists[nlists++].list);
+		}
+
+		// free all blocks, whatever is still allocated in them. containers on this
+		// heap must not be touched anymore (not even destroyed), it is for dropping
+		// a huge container without visiting its nodes
+		void release() throw() {
+			while(nlists > 0) {
+				nlists--;
+				lists[nlists].destroy(lists[nlists].list);
+			}
+		}
+
+	private:
+		static const int max_lists = 16;
+		struct entry {
+			const void *key;
+			void *list;
+			void (*destroy)(void*);
+		};
+
+		int refs;
+		bool owned;
+		int nlists;
+		entry lists[max_lists];
+
+		template <typename Pool>
+		static void destroy(void *p) {
+			typename Pool::block_list *l = static_cast<typename Pool::block_list*>(p);
+			l->release();
+			l->~block_list();
+			free(l);
+		}
+
+		block_heap(const block_heap&);
+		block_heap &operator=(const block_heap&);
+	};
+
+	template <typename T, int number_of_slots=block_slots<T>::value, typename Policy=block_policy>
+	class block_allocator;
+
+	// specialize for void:
+	template <int number_of_slots, typename Policy> class block_allocator<void,number_of_slots,Policy> {
+	public:
+		typedef void*       pointer;
+		typedef const void* const_pointer;
+		//  reference-to-void members are impossible.
+		typedef void  value_type;
+		template <class U> struct rebind { typedef block_allocator<U, block_slots<U>::value, Policy> other; };
+	};
+
+	template <class T, int _number_of_slots, typename Policy> class block_allocator {
+	public:
+		typedef size_t    size_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef T*        pointer;
+		typedef const T*  const_pointer;
+		typedef T&        reference;
+		typedef const T&  const_reference;
+		typedef T         value_type;
+
+		template <class U>
+		struct rebind { typedef block_allocator<U, block_slots<U>::value, Policy> other; };
+
+		typedef Policy policy;
+		typedef typename Policy::threading threading;
+		typedef typename Policy::stats stats;
+		typedef typename Policy::checks checks;
+
+		// the pool of the size class of T
+		typedef block_size_class<sizeof(T), __alignof__(T)> size_class;
+		typedef block_pool<size_class::size, size_class::align, _number_of_slots, Policy> pool;
+		typedef typename pool::block_list block_list;
+
+		//===========================
+
+		typedef block_heap<Policy> heap_type;
+
+		// the shared pools
+		block_allocator() throw()
+			: heap(0), blocks(&pool::blocks_static)
+		{}
+		// the pools of a heap (see block_heap)
+		explicit block_allocator(heap_type &h) throw()
+			: heap(0), blocks(&pool::blocks_static)
+		{ use(&h); }
+		block_allocator(const block_allocator &other) throw()
+			: heap(other.heap), blocks(other.blocks)
+		{
+			if(heap)
+				heap->ref();
+		}
+		template <class U, int __number_of_slots>
+		block_allocator(const block_allocator<U, __number_of_slots, Policy> &other) throw()
+			: heap(0), blocks(&pool::blocks_static)
+		{
+			// same heap, but the list of our size class in there
+			use(other.heap);
+		}
+
+		block_allocator &operator=(const block_allocator &other) throw() {
+			if(other.heap)
+				other.heap->ref();
+			if(heap)
+				heap->unref();
+			heap = other.heap;
+			blocks = other.blocks;
+			return *this;
+		}
+
+		~block_allocator() throw() {
+			if(heap)
+				heap->unref();
+		}
+
+		// the layout of the pool of T
+		static block_layout layout_report() {
+			block_layout l = pool::layout_report();
+			l.object_size = sizeof(T);
+			return l;
+		}
+
+		// heap this allocates from, 0 for the shared pools
+		heap_type *get_heap() const throw()
+		{ return heap; }
+
+		pointer address(reference x) const
+		{ return &x; }
+		const_pointer address(const_reference x) const
+		{ return &x; }
+
+		size_type max_size() const throw()
+		{ return size_type(-1) / sizeof(T); }
+
+		void construct(pointer p, const T& val)
+		{ new(p) T(val); }
+		void destroy(pointer p)
+		{ p->~T(); }
+
+#if __cplusplus >= 201103L
+		// C++11 allocator_traits (the heap follows the elements)
+		typedef std::true_type propagate_on_container_copy_assignment;
+		typedef std::true_type propagate_on_container_move_assignment;
+		typedef std::true_type propagate_on_container_swap;
+		typedef std::false_type is_always_equal;
+
+		template<typename U, typename... Args>
+		void construct(U *p, Args&&... args)
+		{ ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+		template<typename U>
+		void destroy(U *p)
+		{ p->~U(); }
+#endif
+
+		// one object at a time comes from the pool, arrays (vector, hash buckets)
+		// go straight to the system. an object goes next to 'hint' (or the
+		// hint of a hint_scope) when there is room, the hint has to point
+		// into an object of this allocator or its rebinds
+		pointer allocate(size_type n, typename block_allocator<void, _number_of_slots, Policy>::const_pointer hint = 0) {
+			if(n != 1)
+				return allocate_array(n);
+			const void *&scoped = block_hinting<Policy>::near();
+			const void *near = hint ? hint : scoped;
+			scoped = 0;
+			// (counted first, a slot that fails a check is still taken)
+			checks::template live<T>(1);
+			pointer r = static_cast<pointer>(shared() ? pool::allocate(near) : blocks->allocate(near));
+			if(!r) {
+				checks::template live<T>(-1);
+				throw std::bad_alloc();
+			}
+			stats::allocated(sizeof(T));
+			return r;
+		}
+		void deallocate(pointer p, size_type n) {
+			if(!p)
+				return;
+			if(n != 1) {
+				stats::deallocated(n * sizeof(T));
+				free(p);
+				return;
+			}
+			stats::deallocated(sizeof(T));
+			if(shared())
+				pool::deallocate(p);
+			else
+				blocks->deallocate(p);
+			checks::template live<T>(-1);
+		}
+
+		// n objects at once into out, claimed from the bitmaps a word at a time
+		// (all of them or bad_alloc)
+		void allocate_batch(size_type n, pointer *out) {
+			size_type got = shared() ? pool::allocate_batch(out, n) : blocks->allocate_batch(out, n);
+			for(size_type i = 0; i < got; i++) {
+				stats::allocated(sizeof(T));
+				checks::template live<T>(1);
+			}
+			if(got < n) {
+				deallocate_batch(out, got);
+				throw std::bad_alloc();
+			}
+		}
+		// free n objects at once, best when neighbours in ptrs share blocks (as after allocate_batch)
+		void deallocate_batch(pointer *ptrs, size_type n) {
+			for(size_type i = 0; i < n; i++)
+				stats::deallocated(sizeof(T));
+			if(shared())
+				pool::deallocate_batch(ptrs, n);
+			else
+				blocks->deallocate_batch(ptrs, n);
+			for(size_type i = 0; i < n; i++)
+				checks::template live<T>(-1);
+		}
+
+		// free cached empty blocks, see retain_empty
+		void trim(int keep = 0) {
+			if(shared())
+				pool::trim(keep);
+			else
+				blocks->trim(keep);
+		}
+
+		// slots used per block in the pool of T
+		block_occupancy occupancy() const {
+			if(shared())
+				return pool::occupancy();
+			block_occupancy o = block_occupancy();
+			blocks->occupancy(o);
+			return o;
+		}
+
+	private:
+		// to copy ctor or compare with private data, do this
+		template<typename U, int __number_of_slots, typename __Policy>
+		friend class block_allocator;
+		template<typename T1, int N1, typename P1, typename T2, int N2, typename P2>
+		friend bool operator==(const block_allocator<T1, N1, P1> &, const block_allocator<T2, N2, P2> &) throw();
+		template<typename T1, int N1, typename P1, typename T2, int N2, typename P2>
+		friend bool operator!=(const block_allocator<T1, N1, P1> &, const block_allocator<T2, N2, P2> &) throw();
+
+		heap_type *heap;
+		block_list *blocks;		// the shared list or the one in heap
+
+		// concurrent pools pick the list per thread/node, a heap has just the one
+		bool shared() const
+		{ return threading::concurrent && !heap; }
+
+		// take the list of our pool in h (a full heap leaves us on the shared pools)
+		void use(heap_type *h) throw() {
+			block_list *l = h ? h->template list<pool>() : 0;
+			if(!l)
+				return;
+			h->ref();
+			heap = h;
+			blocks = l;
+		}
+
+		pointer allocate_array(size_type n) {
+			if(n > max_size())
+				throw std::bad_alloc();
+			pointer r = static_cast<pointer>(malloc(n * sizeof(T)));
+			if(!r && n)
+				throw std::bad_alloc();
+			stats::allocated(n * sizeof(T));
+			return r;
+		}
+	};
+
+	// then ofc these
+	template<typename T1, int N1, typename P1, typename T2, int N2, typename P2>
+	bool operator==(const block_allocator<T1, N1, P1> &a, const block_allocator<T2, N2, P2> &b) throw()
+	{ return a.heap == b.heap; }
+
+	template<typename T1, int N1, typename P1, typename T2, int N2, typename P2>
+	bool operator!=(const block_allocator<T1, N1, P1> &a, const block_allocator<T2, N2, P2> &b) throw()
+	{ return a.heap != b.heap; }
+
+	/*
+		While alive, the lists of all pools of Policy stop allocating from blocks
+		they already had that are less than below_percent used (they are sealed,
+		frees still go to them). So whatever is allocated meanwhile is packed
+		into the fuller blocks and new ones. Applies to all threads using Policy,
+		keep it short.
+	*/
+	template <typename Policy>
+	class compaction_scope {
+	public:
+		explicit compaction_scope(int below_percent = 50) {
+			__atomic_add_fetch(&block_compaction<Policy>::epoch, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&block_compaction<Policy>::below, below_percent, __ATOMIC_RELAXED);
+		}
+		~compaction_scope() {
+			__atomic_store_n(&block_compaction<Policy>::below, 0, __ATOMIC_RELAXED);
+		}
+	private:
+		compaction_scope(const compaction_scope&);
+		compaction_scope &operator=(const compaction_scope&);
+	};
+
+	/*
+		While alive, the lists of all pools of Policy claim a whole bitmap word
+		of slots when they need one and hand the next ones out of that, so
+		bulk loading goes to the bitmaps and the list bookkeeping once per word.
+		Applies to all threads using Policy. Unused claimed slots stay with their
+		list until it allocates again or is trimmed.
+	*/
+	template <typename Policy>
+	class batch_scope {
+	public:
+		batch_scope() { __atomic_add_fetch(&block_batching<Policy>::active, 1, __ATOMIC_RELAXED); }
+		~batch_scope() { __atomic_sub_fetch(&block_batching<Policy>::active, 1, __ATOMIC_RELAXED); }
+	private:
+		batch_scope(const batch_scope&);
+		batch_scope &operator=(const batch_scope&);
+	};
+
+	/*
+		The next object allocated with Policy on this thread goes next to 'near'
+		(in its block or the blocks around it) when there is room, for the
+		containers that do not pass a hint to their allocator. It is used
+		once, so make the scope right around the insert (see insert_near).
+	*/
+	template <typename Policy>
+	class hint_scope {
+	public:
+		explicit hint_scope(const void *near) { block_hinting<Policy>::near() = near; }
+		~hint_scope() { block_hinting<Policy>::near() = 0; }
+	private:
+		hint_scope(const hint_scope&);
+		hint_scope &operator=(const hint_scope&);
+	};
+
+	// insert a value before pos in a node container (list, or map, set.. where
+	// pos is the usual insert hint) on a block_allocator, its node next to the
+	// node of pos (or the last one at end), so walking the container stays
+	// within fewer cache lines and pages
+	template <typename Container>
+	typename Container::iterator insert_near(Container &c, typename Container::iterator pos,
+		const typename Container::value_type &value)
+	{
+		const void *near = 0;
+		if(pos != c.end())
+			near = &*pos;
+		else if(!c.empty()) {
+			typename Container::iterator last = pos;
+			near = &*--last;
+		}
+		hint_scope<typename Container::allocator_type::policy> scope(near);
+		return c.insert(pos, value);
+	}
+
+	// insert a range at the end of a node container (list, map, set..) on a
+	// block_allocator in a batch_scope
+	template <typename Container, typename InputIterator>
+	void insert_batched(Container &c, InputIterator first, InputIterator last) {
+		batch_scope<typename Container::allocator_type::policy> scope;
+		for(; first != last; ++first)
+			c.insert(c.end(), *first);
+	}
+
+	// rebuild a node container (list, map, set..) on a block_allocator into densely
+	// packed blocks: copy it in a compaction_scope and swap. the elements are
+	// copied, so iterators and pointers into c are invalidated
+	template <typename Container>
+	void compact(Container &c, int below_percent = 50) {
+		compaction_scope<typename Container::allocator_type::policy> scope(below_percent);
+		Container packed(c);
+		c.swap(packed);
+	}
+
+	//===================================================
+
+	/*
+		All size classes up to max_size, picked at runtime for when the size is
+		only known at runtime (memory resources, operator new). These are the
+		same pools block_allocator uses.
+
+		A slot of n bytes is aligned to at least the largest power of two
+		dividing n (up to a cache line), so to get alignment a round n up
+		to a multiple of a first.
+	*/
+	template <typename Policy = block_policy>
+	struct block_size_pools {
+		typedef typename Policy::stats stats;
+
+		// 8..64 by 8, 80..256 by 16, 320..1024 by 64
+		static const int classes = 32;
+		static const size_t max_size = 1024;
+
+		// class index of n bytes (n <= max_size)
+		static int index(size_t n) {
+			if(n <= 64)
+				return n ? int((n + 7) / 8) - 1 : 0;
+			if(n <= 256)
+				return 8 + int((n - 64 + 15) / 16) - 1;
+			return 20 + int((n - 256 + 63) / 64) - 1;
+		}
+
+		// true if n bytes aligned to align can come from the pools
+		static bool pooled(size_t n, size_t align) {
+			return n <= max_size && align <= cache_line_size;
+		}
+
+		// returns 0 when out of memory
+		static void *allocate(size_t n) {
+			void *p = table().allocate[index(n)]();
+			if(p)
+				stats::allocated(n);
+			return p;
+		}
+		static void deallocate(void *p, size_t n) {
+			stats::deallocated(n);
+			table().deallocate[index(n)](p);
+		}
+
+		// free cached empty blocks of every class
+		static void trim(int keep = 0) {
+			for(int i = 0; i < classes; i++)
+				table().trim[i](keep);
+		}
+
+		// pool of class i
+		template <int i> struct class_pool {
+			static const size_t size = i < 8 ? (i + 1) * 8 : i < 20 ? 64 + (i - 7) * 16 : 256 + (i - 19) * 64;
+			typedef block_size_class<size> size_class;
+			typedef block_pool<size_class::size, size_class::align,
+				block_size_slots<size_class::size>::value, Policy> type;
+		};
+
+	private:
+		// allocate/deallocate of every class, filled in on first use
+		struct functions {
+			void *(*allocate[classes])();
+			void (*deallocate[classes])(void*);
+			void (*trim[classes])(int);
+
+			functions() { filler<0>::fill(*this); }
+		};
+
+		template <int i, bool __last = (i + 1 == classes)> struct filler {
+			static void fill(functions &f) {
+				f.allocate[i] = &class_pool<i>::type::allocate;
+				f.deallocate[i] = &class_pool<i>::type::deallocate;
+				f.trim[i] = &class_pool<i>::type::trim;
+				filler<i + 1>::fill(f);
+			}
+		};
+		template <int i> struct filler<i, true> {
+			static void fill(functions &f) {
+				f.allocate[i] = &class_pool<i>::type::allocate;
+				f.deallocate[i] = &class_pool<i>::type::deallocate;
+				f.trim[i] = &class_pool<i>::type::trim;
+			}
+		};
+
+		static functions &table() {
+			static functions f;
+			return f;
+		}
+	};
+
+	//===================================================
+
+	/*
+		Fixed size pool where any thread allocates and frees with a single CAS,
+		for objects that are made on one thread and freed on another.
+
+		Free slots are a Treiber stack. The head is one 64 bit word, the index
+		of the top slot and a tag that changes on every push and pop, so a pop
+		that raced with a pop and push of the same slot (ABA) fails its CAS.
+		Slots are addressed by 32 bit index into chunks that are never freed,
+		chunk k has ChunkSlots << k slots, so the link read from a slot that
+		was taken meanwhile is garbage but never a fault.
+		Memory only goes back to the system with the process, like the
+		free lists of most mallocs.
+	*/
+	template <size_t _slot_size, size_t _slot_align, typename Stats = null_stats, size_t ChunkSlots = 1024>
+	struct lockfree_pool {
+		// a free slot keeps the index of the next one in its first word
+		static const size_t slot_align = _slot_align < sizeof(uint32_t) ? sizeof(uint32_t) : _slot_align;
+		static const size_t slot_size = (_slot_size + slot_align - 1) & ~(slot_align - 1);
+		static const uint32_t nil = ~uint32_t(0);
+		static const int max_chunks = 24;
+
+		static void *allocate() {
+			uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+			for(;;) {
+				uint32_t i = uint32_t(h);
+				if(i == nil) {
+					if(!grow())
+						return 0;
+					h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+					continue;
+				}
+				uint32_t next = peek(i);
+				if(__atomic_compare_exchange_n(&head, &h, tagged(h, next),
+					true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+					return slot(i);
+			}
+		}
+
+		static void deallocate(void *p) {
+			uint32_t i = index(p);
+			uint64_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+			do {
+				__atomic_store_n(link(i), uint32_t(h), __ATOMIC_RELAXED);
+			} while(!__atomic_compare_exchange_n(&head, &h, tagged(h, i),
+				true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		}
+
+		// slots in all chunks so far
+		static size_t capacity() {
+			size_t n = 0;
+			for(int k = 0; k < __atomic_load_n(&nchunks, __ATOMIC_ACQUIRE); k++)
+				n += ChunkSlots << k;
+			return n;
+		}
+
+		// tag << 32 | index of the top free slot, on a line of its own
+		static uint64_t head __attribute__((aligned(cache_line_size)));
+		static char *chunks[max_chunks];
+		static int nchunks;
+		static __spinlock grow_lock;
+
+	private:
+		static uint64_t tagged(uint64_t h, uint32_t i) {
+			return ((h >> 32) + 1) << 32 | i;
+		}
+
+		// index i lives in chunk k at offset j, see the comment on top
+		static void *slot(uint32_t i) {
+			uint64_t n = uint64_t(i) / ChunkSlots + 1;
+			int k = int(sizeof(unsigned long long) * 8) - 1 - __builtin_clzll(n);
+			uint64_t first = uint64_t(ChunkSlots) * ((uint64_t(1) << k) - 1);
+			return chunks[k] + (i - first) * slot_size;
+		}
+		static uint32_t *link(uint32_t i) {
+			return static_cast<uint32_t*>(slot(i));
+		}
+		// the link of a slot on top of the stack, it may be stale if the slot
+		// was popped meanwhile (and is being written by its new owner), then
+		// the tag has moved on and the CAS fails. hidden from ThreadSanitizer,
+		// to which that read is a race with the owner
+		static uint32_t peek(uint32_t i) __attribute__((no_sanitize_thread)) {
+			return __atomic_load_n(link(i), __ATOMIC_RELAXED);
+		}
+		static uint32_t index(void *p) {
+			// the chunk that p is in (few of them, newest first as that is where most slots are)
+			for(int k = __atomic_load_n(&nchunks, __ATOMIC_ACQUIRE) - 1; k >= 0; k--) {
+				size_t off = size_t(static_cast<char*>(p) - chunks[k]);
+				if(static_cast<char*>(p) >= chunks[k] && off < (ChunkSlots << k) * slot_size)
+					return uint32_t(ChunkSlots * ((size_t(1) << k) - 1) + off / slot_size);
+			}
+			throw std::bad_alloc();
+		}
+
+		// add a chunk and push all its slots at once, false if out of memory
+		static bool grow() {
+			grow_lock.lock();
+			bool ok = true;
+			int k = nchunks;
+			// someone else just did
+			if(uint32_t(__atomic_load_n(&head, __ATOMIC_ACQUIRE)) != nil)
+				;
+			else if(k == max_chunks || uint64_t(ChunkSlots) * ((uint64_t(1) << (k + 1)) - 1) >= nil)
+				ok = false;
+			else {
+				size_t n = ChunkSlots << k;
+				void *mem;
+				if(posix_memalign(&mem, slot_align > cache_line_size ? slot_align : cache_line_size, n * slot_size) != 0)
+					ok = false;
+				else {
+					Stats::block_allocated(n * slot_size);
+					chunks[k] = static_cast<char*>(mem);
+					__atomic_store_n(&nchunks, k + 1, __ATOMIC_RELEASE);
+					uint32_t first = uint32_t(ChunkSlots * ((size_t(1) << k) - 1));
+					for(size_t j = 0; j + 1 < n; j++)
+						*reinterpret_cast<uint32_t*>(chunks[k] + j * slot_size) = uint32_t(first + j + 1);
+					uint32_t *last = reinterpret_cast<uint32_t*>(chunks[k] + (n - 1) * slot_size);
+					uint64_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+					do {
+						__atomic_store_n(last, uint32_t(h), __ATOMIC_RELAXED);
+					} while(!__atomic_compare_exchange_n(&head, &h, tagged(h, first),
+						true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+				}
+			}
+			grow_lock.unlock();
+			return ok;
+		}
+	};
+
+	template <size_t _slot_size, size_t _slot_align, typename Stats, size_t ChunkSlots>
+	uint64_t lockfree_pool<_slot_size, _slot_align, Stats, ChunkSlots>::head =
+		lockfree_pool<_slot_size, _slot_align, Stats, ChunkSlots>::nil;
+	template <size_t _slot_size, size_t _slot_align, typename Stats, size_t ChunkSlots>
+	char *lockfree_pool<_slot_size, _slot_align, Stats, ChunkSlots>::chunks[max_chunks];
+	template <size_t _slot_size, size_t _slot_align, typename Stats, size_t ChunkSlots>
+	int lockfree_pool<_slot_size, _slot_align, Stats, ChunkSlots>::nchunks = 0;
+	template <size_t _slot_size, size_t _slot_align, typename Stats, size_t ChunkSlots>
+	__spinlock lockfree_pool<_slot_size, _slot_align, Stats, ChunkSlots>::grow_lock;
+
+	// allocator on the lockfree_pool of the size class of T (one object at a
+	// time, arrays go to malloc). stateless, all of them share the pools
+	template <class T, typename Stats = null_stats> class lockfree_allocator;
+	// specialize for void:
+	template <typename Stats> class lockfree_allocator<void, Stats> {
+	public:
+		typedef void*       pointer;
+		typedef const void* const_pointer;
+		//  reference-to-void members are impossible.
+		typedef void  value_type;
+		template <class U> struct rebind { typedef lockfree_allocator<U, Stats> other; };
+	};
+
+	template <typename T, typename Stats>
+	class lockfree_allocator {
+	public:
+		typedef size_t    size_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef T*        pointer;
+		typedef const T*  const_pointer;
+		typedef T&        reference;
+		typedef const T&  const_reference;
+		typedef T         value_type;
+		template <class U> struct rebind { typedef lockfree_allocator<U, Stats> other; };
+
+		typedef block_size_class<sizeof(T), __alignof__(T)> size_class;
+		typedef lockfree_pool<size_class::size, size_class::align, Stats> pool;
+
+		lockfree_allocator() throw() {}
+		lockfree_allocator(const lockfree_allocator &) throw() {}
+		template<typename U> lockfree_allocator(const lockfree_allocator<U, Stats>&) throw() {}
+
+		~lockfree_allocator() throw() {}
+
+		pointer address(reference x) const
+		{ return &x; }
+		const_pointer address(const_reference x) const
+		{ return &x; }
+		size_type max_size() const throw()
+		{ return size_type(-1) / sizeof(T); }
+
+		void construct(pointer p, const T& val)
+		{ new(p) T(val); }
+		void destroy(pointer p)
+		{ p->~T(); }
+
+#if __cplusplus >= 201103L
+		// C++11 allocator_traits
+		typedef std::true_type propagate_on_container_copy_assignment;
+		typedef std::true_type propagate_on_container_move_assignment;
+		typedef std::true_type propagate_on_container_swap;
+		typedef std::true_type is_always_equal;
+
+		template<typename U, typename... Args>
+		void construct(U *p, Args&&... args)
+		{ ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+		template<typename U>
+		void destroy(U *p)
+		{ p->~U(); }
+#endif
+
+		pointer allocate(size_type n, typename lockfree_allocator<void, Stats>::const_pointer hint = 0) {
+			pointer p;
+			if(n != 1) {
+				if(n > max_size())
+					throw std::bad_alloc();
+				p = static_cast<pointer>(malloc(n * sizeof(T)));
+			}
+			else
+				p = static_cast<pointer>(pool::allocate());
+			if(!p)
+				throw std::bad_alloc();
+			Stats::allocated(n * sizeof(T));
+			return p;
+		}
+		void deallocate(pointer p, size_type n) {
+			if(!p)
+				return;
+			Stats::deallocated(n * sizeof(T));
+			if(n != 1)
+				free(p);
+			else
+				pool::deallocate(p);
+		}
+	};
+
+	template<typename T1, typename T2, typename Stats>
+	bool operator==(const lockfree_allocator<T1, Stats> &, const lockfree_allocator<T2, Stats> &) throw()
+	{ return true; }
+
+	template<typename T1, typename T2, typename Stats>
+	bool operator!=(const lockfree_allocator<T1, Stats> &, const lockfree_allocator<T2, Stats> &) throw()
+	{ return false; }
+
+	//===================================================
+
+	// monotonic arena, allocation just bumps a pointer inside a chunk.
+	// nothing is ever freed one by one, you reset() or release() the whole
+	// thing when done with it (eg. at the end of a request)
+	class arena {
+	public:
+		explicit arena(size_t size = 64 * 1024) throw()
+			: chunks(0), cur(0), end(0), chunk_size(size), total(0)
+		{}
+		~arena() throw() { release(); }
+
+		void *allocate(size_t n, size_t align) {
+			char *p = align_up(cur, align);
+			if(!cur || p + n > end) {
+				grow(n + align);
+				p = align_up(cur, align);
+			}
+			cur = p + n;
+			return p;
+		}
+
+		// forget everything, keeps the latest chunk to allocate from again
+		void reset() throw() {
+			if(!chunks)
+				return;
+			while(chunks->next) {
+				chunk *next = chunks->next;
+				chunks->next = next->next;
+				total -= next->size;
+				free(next);
+			}
+			cur = reinterpret_cast<char*>(chunks + 1);
+		}
+
+		// give everything back to the system
+		void release() throw() {
+			while(chunks) {
+				chunk *next = chunks->next;
+				free(chunks);
+				chunks = next;
+			}
+			cur = end = 0;
+			total = 0;
+		}
+
+		// bytes reserved from the system
+		size_t reserved() const throw() { return total; }
+
+	private:
+		// chunk header, memory follows
+		struct chunk {
+			chunk *next;
+			size_t size;
+		};
+		chunk *chunks;		// latest first
+		char *cur;
+		char *end;
+		size_t chunk_size;
+		size_t total;
+
+		static char *align_up(char *p, size_t align) {
+			return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~uintptr_t(align - 1));
+		}
+
+		void grow(size_t n) {
+			size_t size = sizeof(chunk) + std::max(n, chunk_size);
+			chunk *c = static_cast<chunk*>(malloc(size));
+			if(!c)
+				throw std::bad_alloc();
+			c->next = chunks;
+			c->size = size;
+			chunks = c;
+			total += size;
+			cur = reinterpret_cast<char*>(c + 1);
+			end = reinterpret_cast<char*>(c) + size;
+		}
+
+		// not copyable
+		arena(const arena &);
+		arena &operator=(const arena &);
+	};
+
+	// allocator class for an arena, deallocate does nothing
+	template <class T> class arena_allocator;
+	// specialize for void:
+	template <> class arena_allocator<void> {
+	public:
+		typedef void*       pointer;
+		typedef const void* const_pointer;
+		//  reference-to-void members are impossible.
+		typedef void  value_type;
+		template <class U> struct rebind { typedef arena_allocator<U> other; };
+	};
+
+	template<typename T>
+	class arena_allocator {
+	public:
+		typedef size_t    size_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef T*        pointer;
+		typedef const T*  const_pointer;
+		typedef T&        reference;
+		typedef const T&  const_reference;
+		typedef T         value_type;
+		template <class U> struct rebind { typedef arena_allocator<U> other; };
+
+		// stateful, there is no default constructor
+		arena_allocator(arena &ar) throw() : a(&ar) {}
+		arena_allocator(const arena_allocator &other) throw() : a(other.a) {}
+		template<typename U> arena_allocator(const arena_allocator<U> &other) throw() : a(&other.get_arena()) {}
+
+		~arena_allocator() throw() {}
+
+		pointer address(reference x) const
+		{ return &x; }
+		const_pointer address(const_reference x) const
+		{ return &x; }
+		size_type max_size() const throw()
+		{ return size_type(-1) / sizeof(T); }
+
+		void construct(pointer p, const T& val)
+		{ new(p) T(val); }
+		void destroy(pointer p)
+		{ p->~T(); }
+
+#if __cplusplus >= 201103L
+		// C++11 allocator_traits
+		typedef std::false_type propagate_on_container_copy_assignment;
+		typedef std::true_type propagate_on_container_move_assignment;
+		typedef std::true_type propagate_on_container_swap;
+		typedef std::false_type is_always_equal;
+
+		template<typename U, typename... Args>
+		void construct(U *p, Args&&... args)
+		{ ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+		template<typename U>
+		void destroy(U *p)
+		{ p->~U(); }
+#endif
+
+		pointer allocate(size_type n, typename arena_allocator<void>::const_pointer hint=0)
+		{ return static_cast<pointer>(a->allocate(n * sizeof(T), __alignof__(T))); }
+		void deallocate(pointer p, size_type n)
+		{}
+
+		arena &get_arena() const throw()
+		{ return *a; }
+
+	private:
+		arena *a;
+	};
+
+	// equal only when sharing an arena
+	template<typename T1, typename T2>
+	bool operator==(const arena_allocator<T1> &a, const arena_allocator<T2> &b) throw()
+	{ return &a.get_arena() == &b.get_arena(); }
+
+	template<typename T1, typename T2>
+	bool operator!=(const arena_allocator<T1> &a, const arena_allocator<T2> &b) throw()
+	{ return &a.get_arena() != &b.get_arena(); }
+
+	//===================================================
+
+	// N bytes inline (on the stack, in an object) for the short_allocators of
+	// a few small short lived containers. allocation bumps a pointer, only
+	// the latest allocation is given back (what a growing vector frees is not),
+	// what does not fit goes to malloc
+	template <size_t N, size_t Align = sizeof(void*) * 2>
+	class short_arena {
+	public:
+		static const size_t size = N;
+
+		short_arena() throw() : cur(buf) {}
+
+		// 0 if it does not fit
+		void *allocate(size_t n, size_t align) throw() {
+			if(align > Align)
+				return 0;
+			char *p = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(cur) + align - 1) & ~uintptr_t(align - 1));
+			if(n > size_t(buf + N - p))
+				return 0;
+			cur = p + n;
+			return p;
+		}
+		void deallocate(void *p, size_t n) throw() {
+			if(static_cast<char*>(p) + n == cur)
+				cur = static_cast<char*>(p);
+		}
+
+		bool owns(const void *p) const throw()
+		{ return static_cast<const char*>(p) >= buf && static_cast<const char*>(p) < buf + N; }
+		// bytes handed out (the freed ones that were not the latest included)
+		size_t used() const throw() { return size_t(cur - buf); }
+		// everything allocated from it must be gone
+		void reset() throw() { cur = buf; }
+
+	private:
+		char buf[N] __attribute__((aligned(Align)));
+		char *cur;
+
+		// not copyable, the allocators point into it
+		short_arena(const short_arena &);
+		short_arena &operator=(const short_arena &);
+	};
+
+	// allocator class for a short_arena, overflow goes to malloc_allocator<T, Stats>
+	// (so Stats counts only what went to malloc). the arena has to outlive
+	// the containers using it, and those they are swapped with
+	template <class T, size_t N, typename Stats = null_stats> class short_allocator;
+	// specialize for void:
+	template <size_t N, typename Stats> class short_allocator<void, N, Stats> {
+	public:
+		typedef void*       pointer;
+		typedef const void* const_pointer;
+		//  reference-to-void members are impossible.
+		typedef void  value_type;
+		template <class U> struct rebind { typedef short_allocator<U, N, Stats> other; };
+	};
+
+	template<typename T, size_t N, typename Stats>
+	class short_allocator {
+	public:
+		typedef size_t    size_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef T*        pointer;
+		typedef const T*  const_pointer;
+		typedef T&        reference;
+		typedef const T&  const_reference;
+		typedef T         value_type;
+		template <class U> struct rebind { typedef short_allocator<U, N, Stats> other; };
+
+		typedef short_arena<N> arena_type;
+
+		// stateful, there is no default constructor
+		short_allocator(arena_type &ar) throw() : a(&ar) {}
+		short_allocator(const short_allocator &other) throw() : a(other.a) {}
+		template<typename U> short_allocator(const short_allocator<U, N, Stats> &other) throw() : a(&other.get_arena()) {}
+
+		~short_allocator() throw() {}
+
+		pointer address(reference x) const
+		{ return &x; }
+		const_pointer address(const_reference x) const
+		{ return &x; }
+		size_type max_size() const throw()
+		{ return size_type(-1) / sizeof(T); }
+
+		void construct(pointer p, const T& val)
+		{ new(p) T(val); }
+		void destroy(pointer p)
+		{ p->~T(); }
+
+#if __cplusplus >= 201103L
+		// C++11 allocator_traits (copies and moves into a container on another
+		// arena go element by element, swap swaps the arenas too, so both
+		// arenas have to outlive both containers)
+		typedef std::false_type propagate_on_container_copy_assignment;
+		typedef std::false_type propagate_on_container_move_assignment;
+		typedef std::true_type propagate_on_container_swap;
+		typedef std::false_type is_always_equal;
+
+		template<typename U, typename... Args>
+		void construct(U *p, Args&&... args)
+		{ ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+		template<typename U>
+		void destroy(U *p)
+		{ p->~U(); }
+#endif
+
+		pointer allocate(size_type n, typename short_allocator<void, N, Stats>::const_pointer hint=0)
+		{
+			if(n <= N / sizeof(T)) {
+				pointer p = static_cast<pointer>(a->allocate(n * sizeof(T), __alignof__(T)));
+				if(p)
+					return p;
+			}
+			return malloc_allocator<T, Stats>().allocate(n);
+		}
+		void deallocate(pointer p, size_type n)
+		{
+			if(a->owns(p))
+				a->deallocate(p, n * sizeof(T));
+			else
+				malloc_allocator<T, Stats>().deallocate(p, n);
+		}
+
+		arena_type &get_arena() const throw()
+		{ return *a; }
+
+	private:
+		arena_type *a;
+	};
+
+	// equal only when sharing an arena
+	template<typename T1, typename T2, size_t N, typename Stats>
+	bool operator==(const short_allocator<T1, N, Stats> &a, const short_allocator<T2, N, Stats> &b) throw()
+	{ return &a.get_arena() == &b.get_arena(); }
+
+	template<typename T1, typename T2, size_t N, typename Stats>
+	bool operator!=(const short_allocator<T1, N, Stats> &a, const short_allocator<T2, N, Stats> &b) throw()
+	{ return &a.get_arena() != &b.get_arena(); }
+
+	//===================================================
+
+	/*
+		A byte budget for the containers of one subsystem (one per Tag), see
+		budget_allocator. Up to the hard limit charges succeed, past it they
+		fail, and the first charge that takes the bytes in use over the soft
+		limit calls the soft handler (to evict from a cache, trim pools..).
+
+		Each thread takes bytes from the shared count a Batch at a time and
+		charges from that, so most charges and releases only touch a thread
+		local counter. A thread holds at most 2 * Batch in advance, given back
+		when it exits or calls flush(), so the limits are that precise.
+	*/
+	template <typename Tag = void, size_t Batch = 64 * 1024>
+	struct memory_budget {
+		typedef void (*soft_handler)(size_t used);
+
+		struct state {
+			size_t used;		// taken from the budget, threads' advances included
+			size_t hard;		// 0 for no limit
+			size_t soft;
+			soft_handler on_soft;
+			size_t rejected;		// charges that failed
+		};
+		static state &get() {
+			static state s;
+			return s;
+		}
+
+		// limits in bytes, 0 for none
+		static void set_limits(size_t hard, size_t soft = 0, soft_handler on_soft = 0) {
+			state &s = get();
+			__atomic_store_n(&s.on_soft, on_soft, __ATOMIC_RELAXED);
+			__atomic_store_n(&s.soft, soft, __ATOMIC_RELAXED);
+			__atomic_store_n(&s.hard, hard, __ATOMIC_RELAXED);
+		}
+
+		static size_t used() { return __atomic_load_n(&get().used, __ATOMIC_RELAXED); }
+		static size_t rejected() { return __atomic_load_n(&get().rejected, __ATOMIC_RELAXED); }
+
+		// take n bytes, false if that would go over the hard limit
+		static bool charge(size_t n) {
+			size_t &c = credit();
+			if(n <= c) {
+				c -= n;
+				return true;
+			}
+			// what is missing and a batch in advance, near the limit just what is missing
+			size_t missing = n - c;
+			size_t got = reserve(missing + Batch) ? missing + Batch : reserve(missing) ? missing : 0;
+			if(!got) {
+				__atomic_add_fetch(&get().rejected, 1, __ATOMIC_RELAXED);
+				return false;
+			}
+			c = c + got - n;
+			registered();
+			return true;
+		}
+
+		// give n charged bytes back (a thread that only frees holds an
+		// advance too, flushed when it exits)
+		static void release(size_t n) {
+			size_t &c = credit();
+			c += n;
+			registered();
+			if(c > 2 * Batch) {
+				__atomic_sub_fetch(&get().used, c - Batch, __ATOMIC_RELAXED);
+				c = Batch;
+			}
+		}
+
+		// give back what the calling thread holds in advance
+		static void flush() {
+			size_t &c = credit();
+			if(c) {
+				__atomic_sub_fetch(&get().used, c, __ATOMIC_RELAXED);
+				c = 0;
+			}
+		}
+
+	private:
+		static size_t &credit() { static __thread size_t c = 0; return c; }
+
+		// n more bytes in use, unless over the hard limit
+		static bool reserve(size_t n) {
+			state &s = get();
+			size_t used = __atomic_add_fetch(&s.used, n, __ATOMIC_RELAXED);
+			size_t hard = __atomic_load_n(&s.hard, __ATOMIC_RELAXED);
+			if(hard && used > hard) {
+				__atomic_sub_fetch(&s.used, n, __ATOMIC_RELAXED);
+				return false;
+			}
+			size_t soft = __atomic_load_n(&s.soft, __ATOMIC_RELAXED);
+			if(soft && used > soft && used - n <= soft) {
+				soft_handler h = __atomic_load_n(&s.on_soft, __ATOMIC_RELAXED);
+				if(h)
+					h(used);
+			}
+			return true;
+		}
+
+		// flush the advance of a thread when it exits
+		static void registered() {
+			static __thread bool done = false;
+			if(done)
+				return;
+			done = true;
+			static pthread_key_t key = thread_key();
+			pthread_setspecific(key, &get());
+		}
+		static pthread_key_t thread_key() {
+			pthread_key_t key;
+			pthread_key_create(&key, &thread_exit);
+			return key;
+		}
+		static void thread_exit(void *) {
+			flush();
+		}
+	};
+
+	// allocator class that charges a memory_budget for what it allocates
+	// from Alloc (malloc_allocator, block_allocator..), bad_alloc when over
+	// the hard limit, or 0 from try_allocate
+	template <class T, typename Budget, typename Alloc = malloc_allocator<T> > class budget_allocator;
+	// specialize for void:
+	template <typename Budget, typename Alloc> class budget_allocator<void, Budget, Alloc> {
+	public:
+		typedef void*       pointer;
+		typedef const void* const_pointer;
+		//  reference-to-void members are impossible.
+		typedef void  value_type;
+		template <class U> struct rebind {
+			typedef budget_allocator<U, Budget, typename Alloc::template rebind<U>::other> other;
+		};
+	};
+
+	template<typename T, typename Budget, typename Alloc>
+	class budget_allocator {
+	public:
+		typedef size_t    size_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef T*        pointer;
+		typedef const T*  const_pointer;
+		typedef T&        reference;
+		typedef const T&  const_reference;
+		typedef T         value_type;
+		template <class U> struct rebind {
+			typedef budget_allocator<U, Budget, typename Alloc::template rebind<U>::other> other;
+		};
+
+		typedef Budget budget_type;
+		typedef Alloc inner_allocator_type;
+
+		budget_allocator(const Alloc &inner = Alloc()) throw() : a(inner) {}
+		budget_allocator(const budget_allocator &other) throw() : a(other.a) {}
+		template<typename U, typename A>
+		budget_allocator(const budget_allocator<U, Budget, A> &other) throw() : a(other.inner_allocator()) {}
+
+		~budget_allocator() throw() {}
+
+		budget_allocator &operator=(const budget_allocator &other) throw() {
+			a = other.a;
+			return *this;
+		}
+
+		pointer address(reference x) const
+		{ return &x; }
+		const_pointer address(const_reference x) const
+		{ return &x; }
+		size_type max_size() const throw()
+		{ return size_type(-1) / sizeof(T); }
+
+		void construct(pointer p, const T& val)
+		{ new(p) T(val); }
+		void destroy(pointer p)
+		{ p->~T(); }
+
+#if __cplusplus >= 201103L
+		// C++11 allocator_traits (as the inner allocator)
+		typedef typename std::allocator_traits<Alloc>::propagate_on_container_copy_assignment propagate_on_container_copy_assignment;
+		typedef typename std::allocator_traits<Alloc>::propagate_on_container_move_assignment propagate_on_container_move_assignment;
+		typedef typename std::allocator_traits<Alloc>::propagate_on_container_swap propagate_on_container_swap;
+		typedef typename std::allocator_traits<Alloc>::is_always_equal is_always_equal;
+
+		template<typename U, typename... Args>
+		void construct(U *p, Args&&... args)
+		{ ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+		template<typename U>
+		void destroy(U *p)
+		{ p->~U(); }
+#endif
+
+		pointer allocate(size_type n, typename budget_allocator<void, Budget, Alloc>::const_pointer hint=0)
+		{
+			if(n > max_size() || !Budget::charge(n * sizeof(T)))
+				throw std::bad_alloc();
+			try {
+				return a.allocate(n, hint);
+			} catch(...) {
+				Budget::release(n * sizeof(T));
+				throw;
+			}
+		}
+		// same, but 0 when over budget or out of memory
+		pointer try_allocate(size_type n) throw()
+		{
+			if(n > max_size() || !Budget::charge(n * sizeof(T)))
+				return 0;
+			try {
+				return a.allocate(n);
+			} catch(...) {
+				Budget::release(n * sizeof(T));
+				return 0;
+			}
+		}
+		void deallocate(pointer p, size_type n)
+		{
+			if(!p)
+				return;
+			a.deallocate(p, n);
+			Budget::release(n * sizeof(T));
+		}
+
+		const Alloc &inner_allocator() const throw()
+		{ return a; }
+
+	private:
+		Alloc a;
+	};
+
+	// equal when the inner allocators are
+	template<typename T1, typename A1, typename T2, typename A2, typename Budget>
+	bool operator==(const budget_allocator<T1, Budget, A1> &a, const budget_allocator<T2, Budget, A2> &b) throw()
+	{ return a.inner_allocator() == b.inner_allocator(); }
+
+	template<typename T1, typename A1, typename T2, typename A2, typename Budget>
+	bool operator!=(const budget_allocator<T1, Budget, A1> &a, const budget_allocator<T2, Budget, A2> &b) throw()
+	{ return a.inner_allocator() != b.inner_allocator(); }
 }
 
 #endif // ALLOCATOR_H_INCLUDED
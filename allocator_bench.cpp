@@ -0,0 +1,372 @@
+/*
+	allocator benchmarks
+
+	every case runs in a forked child so that peak RSS belongs to that case only.
+	usage: allocator_bench [max_n]    (sizes go 1e3, 1e4 .. max_n, default 1e6)
+*/
+#include "allocator.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+//===================================
+
+// count what goes to the system
+
+static size_t new_calls = 0;
+
+#if __cplusplus >= 201103L
+void *operator new(size_t n) {
+#else
+void *operator new(size_t n) throw(std::bad_alloc) {
+#endif
+	__atomic_add_fetch(&new_calls, 1, __ATOMIC_RELAXED);
+	void *p = malloc(n ? n : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+void operator delete(void *p) throw() {
+	free(p);
+}
+
+struct bench_tag;
+typedef cutepig::counting_stats<bench_tag> bench_stats;
+
+struct bench_block_policy : cutepig::block_policy {
+	typedef bench_stats stats;
+};
+struct bench_mmap_policy : cutepig::block_policy {
+	typedef bench_stats stats;
+	typedef cutepig::mmap_chunks<2 * 1024 * 1024, true> chunks;
+};
+struct bench_concurrent_policy : cutepig::concurrent_block_policy {
+	typedef bench_stats stats;
+};
+
+// allocator families under test, system_allocs tells how many times
+// that family went to the system
+struct std_family {
+	template <typename T> struct alloc { typedef std::allocator<T> type; };
+	static const char *name() { return "std::allocator"; }
+	static size_t system_allocs() { return new_calls; }
+};
+struct malloc_family {
+	template <typename T> struct alloc { typedef cutepig::malloc_allocator<T, bench_stats> type; };
+	static const char *name() { return "malloc_allocator"; }
+	static size_t system_allocs() { return bench_stats::get().allocations; }
+};
+struct block_family {
+	template <typename T> struct alloc {
+		typedef cutepig::block_allocator<T, cutepig::block_slots<T>::value, bench_block_policy> type;
+	};
+	static const char *name() { return "block_allocator"; }
+	static size_t system_allocs() { return bench_stats::get().blocks_allocated; }
+};
+struct mmap_family {
+	template <typename T> struct alloc {
+		typedef cutepig::block_allocator<T, cutepig::block_slots<T>::value, bench_mmap_policy> type;
+	};
+	static const char *name() { return "block_allocator/thp"; }
+	static size_t system_allocs() { return bench_stats::get().blocks_allocated; }
+};
+struct concurrent_family {
+	template <typename T> struct alloc {
+		typedef cutepig::block_allocator<T, cutepig::block_slots<T>::value, bench_concurrent_policy> type;
+	};
+	static const char *name() { return "block_allocator/mt"; }
+	static size_t system_allocs() { return bench_stats::get().blocks_allocated; }
+};
+struct short_family {
+	// (the cases below make the allocator, there is no default one)
+	static const char *name() { return "short_allocator"; }
+	static size_t system_allocs() { return bench_stats::get().allocations; }
+};
+struct lockfree_family {
+	template <typename T> struct alloc { typedef cutepig::lockfree_allocator<T, bench_stats> type; };
+	static const char *name() { return "lockfree_allocator"; }
+	static size_t system_allocs() { return bench_stats::get().blocks_allocated; }
+};
+
+//===================================
+
+// the cases, each returns the number of operations done
+
+// list push/pop churn: fill, then pop front and push back n times
+template <typename F> size_t list_churn(size_t n) {
+	std::list<int, typename F::template alloc<int>::type> l;
+	size_t i;
+	for(i = 0; i < n; i++)
+		l.push_back(int(i));
+	for(i = 0; i < n; i++) {
+		l.pop_front();
+		l.push_back(int(i));
+	}
+	l.clear();
+	return 4 * n;
+}
+
+// map random insert, then random erase
+template <typename F> size_t map_random(size_t n) {
+	typedef std::map<unsigned, unsigned, std::less<unsigned>,
+		typename F::template alloc<std::pair<const unsigned, unsigned> >::type> map;
+	map m;
+	size_t i;
+	unsigned seed = 12345;
+	for(i = 0; i < n; i++)
+		m[rand_r(&seed)] = unsigned(i);
+	seed = 12345;
+	for(i = 0; i < n; i++)
+		m.erase(rand_r(&seed));
+	return 2 * n;
+}
+
+// free in reverse order of allocation
+template <typename F> size_t free_lifo(size_t n) {
+	std::list<int, typename F::template alloc<int>::type> l;
+	size_t i;
+	for(i = 0; i < n; i++)
+		l.push_back(int(i));
+	for(i = 0; i < n; i++)
+		l.pop_back();
+	return 2 * n;
+}
+
+// free in order of allocation
+template <typename F> size_t free_fifo(size_t n) {
+	std::list<int, typename F::template alloc<int>::type> l;
+	size_t i;
+	for(i = 0; i < n; i++)
+		l.push_back(int(i));
+	for(i = 0; i < n; i++)
+		l.pop_front();
+	return 2 * n;
+}
+
+// one thread allocates messages, another frees them
+struct message { char data[40]; };
+
+template <typename F> struct handoff {
+	typedef typename F::template alloc<message>::type alloc;
+	static const size_t ring_size = 1024;
+	message *ring[ring_size];
+	size_t head, tail;		// written by consumer, producer
+	size_t n;
+
+	static void *consumer(void *arg) {
+		handoff *h = static_cast<handoff*>(arg);
+		alloc a;
+		size_t i;
+		for(i = 0; i < h->n; i++) {
+			while(__atomic_load_n(&h->tail, __ATOMIC_ACQUIRE) == h->head)
+				sched_yield();
+			a.deallocate(h->ring[h->head % ring_size], 1);
+			__atomic_store_n(&h->head, h->head + 1, __ATOMIC_RELEASE);
+		}
+		return 0;
+	}
+
+	void producer() {
+		alloc a;
+		size_t i;
+		for(i = 0; i < n; i++) {
+			while(tail - __atomic_load_n(&head, __ATOMIC_ACQUIRE) == ring_size)
+				sched_yield();
+			message *m = a.allocate(1);
+			m->data[0] = char(i);
+			ring[tail % ring_size] = m;
+			__atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+		}
+	}
+};
+
+template <typename F> size_t producer_consumer(size_t n) {
+	handoff<F> *h = new handoff<F>();
+	pthread_t t;
+	h->n = n;
+	pthread_create(&t, 0, &handoff<F>::consumer, h);
+	h->producer();
+	pthread_join(t, 0);
+	delete h;
+	return 2 * n;
+}
+
+// Threads threads allocate messages and swap them with what the others left
+// in a shared table, so about every free is of another threads message
+template <typename F> struct exchange {
+	typedef typename F::template alloc<message>::type alloc;
+	static const size_t table_size = 256;
+	message *table[table_size];
+	size_t n;		// per thread
+
+	struct arg { exchange *e; long t; };
+
+	static void *worker(void *p) {
+		arg *a = static_cast<arg*>(p);
+		exchange *e = a->e;
+		alloc al;
+		size_t i;
+		for(i = 0; i < e->n; i++) {
+			message *m = al.allocate(1);
+			m->data[0] = char(i);
+			m = __atomic_exchange_n(&e->table[(i * 7 + a->t * 31) % table_size], m, __ATOMIC_ACQ_REL);
+			if(m)
+				al.deallocate(m, 1);
+		}
+		return 0;
+	}
+};
+
+template <typename F, int Threads> size_t thread_exchange(size_t n) {
+	typedef exchange<F> ex;
+	ex *e = new ex();
+	pthread_t t[Threads];
+	typename ex::arg args[Threads];
+	long i;
+	e->n = n / Threads;
+	for(i = 0; i < Threads; i++) {
+		args[i].e = e;
+		args[i].t = i;
+		pthread_create(&t[i], 0, &ex::worker, &args[i]);
+	}
+	for(i = 0; i < Threads; i++)
+		pthread_join(t[i], 0);
+	typename ex::alloc al;
+	for(i = 0; i < long(ex::table_size); i++)
+		if(e->table[i])
+			al.deallocate(e->table[i], 1);
+	delete e;
+	return 2 * (n / Threads) * Threads;
+}
+
+// what one call does with its temporary containers: a vector of K ints
+// and a string of K chars, both from allocators rebound from a
+static size_t call_sink = 0;
+
+template <typename A> void short_call(const A &a, size_t k) {
+	std::vector<int, typename A::template rebind<int>::other> v(a);
+	std::basic_string<char, std::char_traits<char>, typename A::template rebind<char>::other> s(a);
+	size_t i;
+	for(i = 0; i < k; i++) {
+		v.push_back(int(i));
+		s += 'x';
+	}
+	call_sink += v.back() + s.size();
+}
+
+// n calls with K sized containers (ns/op is per call)
+template <typename F, size_t K> size_t short_calls(size_t n) {
+	typedef typename F::template alloc<char>::type alloc;
+	size_t i;
+	for(i = 0; i < n; i++)
+		short_call(alloc(), K);
+	return n;
+}
+// same on a 1k short_arena on the stack of each call
+template <size_t K> size_t short_arena_calls(size_t n) {
+	typedef cutepig::short_allocator<char, 1024, bench_stats> alloc;
+	size_t i;
+	for(i = 0; i < n; i++) {
+		alloc::arena_type ar;
+		short_call(alloc(ar), K);
+	}
+	return n;
+}
+
+//===================================
+
+static double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// run in a child, print one line
+template <typename F> void run(const char *what, size_t (*fn)(size_t), size_t n) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid == 0) {
+		size_t before = F::system_allocs();
+		double start = now();
+		size_t ops = fn(n);
+		double elapsed = now() - start;
+		rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		printf("%-18s %-20s %9lu %9.1f %10ld %12lu\n", what, F::name(), (unsigned long)n,
+			elapsed * 1e9 / ops, ru.ru_maxrss, (unsigned long)(F::system_allocs() - before));
+		fflush(stdout);
+		_exit(0);
+	}
+	waitpid(pid, 0, 0);
+}
+
+template <typename F> void run_all(size_t n, bool threads) {
+	run<F>("list churn", &list_churn<F>, n);
+	run<F>("map random", &map_random<F>, n);
+	run<F>("free lifo", &free_lifo<F>, n);
+	run<F>("free fifo", &free_fifo<F>, n);
+	if(threads)
+		run<F>("producer/consumer", &producer_consumer<F>, n);
+}
+
+// the exchange at 1 to 64 threads
+template <typename F> void run_threads(size_t n) {
+	run<F>("exchange x1", &thread_exchange<F, 1>, n);
+	run<F>("exchange x2", &thread_exchange<F, 2>, n);
+	run<F>("exchange x4", &thread_exchange<F, 4>, n);
+	run<F>("exchange x8", &thread_exchange<F, 8>, n);
+	run<F>("exchange x16", &thread_exchange<F, 16>, n);
+	run<F>("exchange x32", &thread_exchange<F, 32>, n);
+	run<F>("exchange x64", &thread_exchange<F, 64>, n);
+}
+
+// per call containers that fit in 1k, and that do not (K = 512)
+template <typename F> void run_short(size_t n) {
+	run<F>("short calls 16", &short_calls<F, 16>, n);
+	run<F>("short calls 64", &short_calls<F, 64>, n);
+	run<F>("short calls 512", &short_calls<F, 512>, n);
+}
+
+int main(int argc, char **argv) {
+	size_t max_n = argc > 1 ? size_t(atof(argv[1])) : 1000000;
+	size_t n;
+
+	printf("%-18s %-20s %9s %9s %10s %12s\n", "case", "allocator", "n", "ns/op", "peak kB", "system allocs");
+	for(n = 1000; n <= max_n; n *= 10) {
+		run_all<std_family>(n, true);
+		run_all<malloc_family>(n, true);
+		// the single threaded block_allocator cannot free from another thread
+		run_all<block_family>(n, false);
+		run_all<mmap_family>(n, false);
+		run_all<concurrent_family>(n, true);
+		run_all<lockfree_family>(n, true);
+	}
+	// small temporary containers, malloc round trips against the stack
+	n = max_n;
+	run_short<std_family>(n);
+	run_short<malloc_family>(n);
+	run<short_family>("short calls 16", &short_arena_calls<16>, n);
+	run<short_family>("short calls 64", &short_arena_calls<64>, n);
+	run<short_family>("short calls 512", &short_arena_calls<512>, n);
+	// scaling with threads (ns/op is wall time over all threads)
+	n = max_n;
+	run_threads<malloc_family>(n);
+	run_threads<concurrent_family>(n);
+	run_threads<lockfree_family>(n);
+	return 0;
+}
@@ -0,0 +1,310 @@
+/*
+allocator_global.h - cutepig pools behind global new/delete and malloc/free
+Copyright (C) 2011  Christian Holmberg
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef ALLOCATOR_GLOBAL_H_INCLUDED
+#define ALLOCATOR_GLOBAL_H_INCLUDED
+
+#include "allocator.h"
+
+namespace cutepig {
+
+	/*
+		One reservation of address space for the blocks of all size classes,
+		SliceBytes for each. Whether a pointer is ours and its class is then
+		a subtraction and a division, which is what free() and unsized delete
+		need. The reservation is PROT_NONE (it costs no memory or commit
+		charge), slices are made usable as they fill up.
+	*/
+	template <size_t SliceBytes, int Slices>
+	struct block_region {
+		// pages are made usable this many at a time
+		static const size_t commit_step = 2 * 1024 * 1024;
+
+		// start of the reservation, 0 if it could not be made
+		static char *base() {
+			char *b = __atomic_load_n(&start, __ATOMIC_ACQUIRE);
+			if(b || __atomic_load_n(&failed, __ATOMIC_RELAXED))
+				return b;
+			lock.lock();
+			if(!start && !failed) {
+				void *m = mmap(0, SliceBytes * Slices, PROT_NONE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+				if(m == MAP_FAILED)
+					__atomic_store_n(&failed, true, __ATOMIC_RELAXED);
+				else
+					__atomic_store_n(&start, static_cast<char*>(m), __ATOMIC_RELEASE);
+			}
+			lock.unlock();
+			return start;
+		}
+
+		static bool owns(const void *p) {
+			char *b = __atomic_load_n(&start, __ATOMIC_ACQUIRE);
+			return b && size_t(static_cast<const char*>(p) - b) < SliceBytes * Slices;
+		}
+		// slice of a pointer that is ours
+		static int slice(const void *p) {
+			return int(size_t(static_cast<const char*>(p) - start) / SliceBytes);
+		}
+
+		// make [p, p + n) usable, false if the system says no
+		static bool commit(char *p, size_t n) {
+			return mprotect(p, n, PROT_READ | PROT_WRITE) == 0;
+		}
+
+		static char *start;
+		static bool failed;
+		static __spinlock lock;
+	};
+
+	template <size_t SliceBytes, int Slices>
+	char *block_region<SliceBytes, Slices>::start = 0;
+	template <size_t SliceBytes, int Slices>
+	bool block_region<SliceBytes, Slices>::failed = false;
+	template <size_t SliceBytes, int Slices>
+	__spinlock block_region<SliceBytes, Slices>::lock;
+
+	/*
+		Chunk policy that carves the blocks of one pool from slice Slice of
+		a block_region (so the pool must be the only user of the slice).
+		Like mmap_chunks, blocks that divide the page are kept by page in
+		regions of commit_step (see page_chunks), others go to a free list,
+		and pages go back with MADV_DONTNEED. A full slice is out of memory.
+	*/
+	template <typename Region, int Slice>
+	struct region_chunks {
+		template <size_t size, size_t align> struct provider {
+			static const size_t stride = (size + align - 1) & ~(align - 1);
+			typedef page_chunks<stride, Region::commit_step> pages;
+
+			static void *allocate() {
+				lock.lock();
+				void *p;
+				if(pages::usable()) {
+					p = grouped.allocate();
+					char *m;
+					if(!p && (m = grow_region())) {
+						grouped.add_region(m);
+						p = grouped.allocate();
+					}
+				}
+				else if((p = freed))
+					freed = *static_cast<void**>(p);
+				else if(grow())
+					p = next, next += stride;
+				lock.unlock();
+				return p;
+			}
+			static void deallocate(void *p) {
+				if(pages::usable()) {
+					lock.lock();
+					grouped.deallocate(p);
+					lock.unlock();
+					return;
+				}
+				size_t page = mmap_chunks<>::page_size();
+				if(size >= 2 * page)
+					madvise(static_cast<char*>(p) + page, (size - page) & ~(page - 1), MADV_DONTNEED);
+				lock.lock();
+				*static_cast<void**>(p) = freed;
+				freed = p;
+				lock.unlock();
+			}
+
+			static __spinlock lock;
+			static pages grouped;		// chunks that divide the page
+			static char *next;		// first chunk (or region) not handed out yet
+			static char *committed;		// end of the usable part of the slice
+			static void *freed;		// released chunks, linked through their first word
+
+		private:
+			// room for one more chunk at next (under the lock)
+			static bool grow() {
+				if(!next) {
+					char *b = Region::base();
+					if(!b)
+						return false;
+					b += Slice * Region::slice_bytes;
+					next = committed = reinterpret_cast<char*>(
+						(reinterpret_cast<uintptr_t>(b) + align - 1) & ~uintptr_t(align - 1));
+				}
+				if(next + stride <= committed)
+					return true;
+				// (committed stays page aligned, the slice and alignments over a page are)
+				char *end = Region::start + (Slice + 1) * Region::slice_bytes;
+				size_t step = std::min(std::max(size_t(Region::commit_step), size_t(stride)), size_t(end - committed));
+				if(next + stride > committed + step || !Region::commit(committed, step))
+					return false;
+				committed += step;
+				return true;
+			}
+
+			// the next commit_step of the slice made usable, for page_chunks
+			// (under the lock)
+			static char *grow_region() {
+				const size_t bytes = Region::commit_step;
+				if(!next) {
+					char *b = Region::base();
+					if(!b)
+						return 0;
+					b += Slice * Region::slice_bytes;
+					next = committed = reinterpret_cast<char*>(
+						(reinterpret_cast<uintptr_t>(b) + bytes - 1) & ~uintptr_t(bytes - 1));
+				}
+				char *end = Region::start + (Slice + 1) * Region::slice_bytes;
+				if(size_t(end - next) < bytes || !Region::commit(next, bytes))
+					return 0;
+				char *r = next;
+				next = committed = next + bytes;
+				return r;
+			}
+		};
+	};
+
+	template <typename Region, int Slice> template <size_t size, size_t align>
+	__spinlock region_chunks<Region, Slice>::provider<size, align>::lock;
+	template <typename Region, int Slice> template <size_t size, size_t align>
+	typename region_chunks<Region, Slice>::template provider<size, align>::pages
+		region_chunks<Region, Slice>::provider<size, align>::grouped;
+	template <typename Region, int Slice> template <size_t size, size_t align>
+	char *region_chunks<Region, Slice>::provider<size, align>::next = 0;
+	template <typename Region, int Slice> template <size_t size, size_t align>
+	char *region_chunks<Region, Slice>::provider<size, align>::committed = 0;
+	template <typename Region, int Slice> template <size_t size, size_t align>
+	void *region_chunks<Region, Slice>::provider<size, align>::freed = 0;
+
+	/*
+		The size classes of block_size_pools, each in a slice of its own of
+		one block_region, for whole programs (see allocator_new.cpp and
+		allocator_preload.cpp). allocate returns 0 for what is not pooled or
+		does not fit anymore, the caller takes it to the system heap, and
+		free tells ours from the rest with owns().
+		The pools use Base for everything but where blocks come from.
+	*/
+	template <typename Base = concurrent_block_policy, size_t SliceBytes = size_t(4) << 30>
+	struct global_pools {
+		typedef block_size_pools<Base> sizes;
+		typedef typename Base::stats stats;
+		static const int classes = sizes::classes;
+		static const size_t max_size = sizes::max_size;
+
+		struct region : block_region<SliceBytes, classes> {
+			static const size_t slice_bytes = SliceBytes;
+		};
+
+		template <int i> struct class_policy : Base {
+			typedef region_chunks<region, i> chunks;
+		};
+		template <int i> struct class_pool {
+			typedef block_size_class<sizes::template class_pool<i>::size> size_class;
+			typedef block_pool<size_class::size, size_class::align,
+				block_size_slots<size_class::size>::value, class_policy<i> > type;
+			typedef typename type::block_list::chunks chunks;
+
+			// the locks of the class, in the order they nest
+			static void lock() { type::abandoned_lock.lock(); chunks::lock.lock(); }
+			static void unlock() { chunks::lock.unlock(); type::abandoned_lock.unlock(); }
+		};
+
+		// bytes a malloc of n has to give, so that anything of that size
+		// fits (16 byte alignment past 8 bytes, like the system heap)
+		static size_t round(size_t n) {
+			return n <= 8 ? 8 : (n + 15) & ~size_t(15);
+		}
+
+		// n bytes (already round()ed, or a multiple of align), 0 if not pooled
+		static void *allocate(size_t n, size_t align = 16) {
+			if(!sizes::pooled(n, align))
+				return 0;
+			int i = sizes::index(n);
+			void *p = table().allocate[i]();
+			if(p)
+				stats::allocated(table().size[i]);
+			return p;
+		}
+
+		static bool owns(const void *p) {
+			return region::owns(p);
+		}
+		// p must be ours
+		static void deallocate(void *p) {
+			int i = region::slice(p);
+			stats::deallocated(table().size[i]);
+			table().deallocate[i](p);
+		}
+		static size_t usable_size(const void *p) {
+			return table().size[region::slice(p)];
+		}
+
+		// free cached empty blocks of every class (of the calling thread)
+		static void trim(int keep = 0) {
+			for(int i = 0; i < classes; i++)
+				table().trim[i](keep);
+		}
+
+		// every lock of the pools taken and given back, for fork(): a lock held
+		// by another thread would stay held in the child (see allocator_preload.cpp)
+		static void lock() {
+			for(int i = 0; i < classes; i++)
+				table().lock[i]();
+			region::lock.lock();
+		}
+		static void unlock() {
+			region::lock.unlock();
+			for(int i = classes - 1; i >= 0; i--)
+				table().unlock[i]();
+		}
+
+	private:
+		struct functions {
+			void *(*allocate[classes])();
+			void (*deallocate[classes])(void*);
+			void (*trim[classes])(int);
+			void (*lock[classes])();
+			void (*unlock[classes])();
+			size_t size[classes];
+
+			functions() { filler<0>::fill(*this); }
+		};
+
+		template <int i, bool __last = (i + 1 == classes)> struct filler {
+			static void fill(functions &f) {
+				filler<i, true>::fill(f);
+				filler<i + 1>::fill(f);
+			}
+		};
+		template <int i> struct filler<i, true> {
+			static void fill(functions &f) {
+				f.allocate[i] = &class_pool<i>::type::allocate;
+				f.deallocate[i] = &class_pool<i>::type::deallocate;
+				f.trim[i] = &class_pool<i>::type::trim;
+				f.lock[i] = &class_pool<i>::lock;
+				f.unlock[i] = &class_pool<i>::unlock;
+				f.size[i] = class_pool<i>::size_class::size;
+			}
+		};
+
+		static functions &table() {
+			static functions f;
+			return f;
+		}
+	};
+}
+
+#endif // ALLOCATOR_GLOBAL_H_INCLUDED
@@ -0,0 +1,153 @@
+/*
+	global operator new/delete on the cutepig pools (libcutepig_new.a)
+
+	link the library into a program to move all its new/delete that fit a
+	size class to the thread cached block pools, without touching its
+	containers. bigger or over aligned ones go to malloc, the pointer tells
+	on delete where it came from.
+*/
+#include "allocator_global.h"
+
+#include <algorithm>
+#include <new>
+#include <pthread.h>	// pthread_atfork
+
+namespace {
+	typedef cutepig::global_pools<> pools;
+
+	// no pool lock held across a fork (see allocator_preload.cpp)
+	__attribute__((constructor)) void fork_safe() {
+		pthread_atfork(&pools::lock, &pools::unlock, &pools::unlock);
+	}
+
+	// like the default operator new: retry with the new_handler until it gives up
+	void *system_new(size_t n, size_t align) {
+		for(;;) {
+			void *p;
+			if(align <= 16)
+				p = malloc(n ? n : 1);
+			else if(posix_memalign(&p, align, n ? n : 1) != 0)
+				p = 0;
+			if(p)
+				return p;
+			std::new_handler h = std::set_new_handler(0);
+			std::set_new_handler(h);
+			if(!h)
+				throw std::bad_alloc();
+			h();
+		}
+	}
+
+	void *pooled_new(size_t n) {
+		void *p = pools::allocate(pools::round(n));
+		return p ? p : system_new(n, 16);
+	}
+	void *pooled_new(size_t n, size_t align) {
+		// a multiple of align is a slot aligned to at least that (round() alone
+		// gives 8 byte slots, also for n == 0)
+		void *p = pools::allocate((std::max(pools::round(n), align) + align - 1) & ~(align - 1), align);
+		return p ? p : system_new(n, align);
+	}
+
+	void pooled_delete(void *p) throw() {
+		if(!p)
+			return;
+		if(pools::owns(p))
+			pools::deallocate(p);
+		else
+			free(p);
+	}
+}
+
+#if __cplusplus >= 201103L
+void *operator new(size_t n) {
+#else
+void *operator new(size_t n) throw(std::bad_alloc) {
+#endif
+	return pooled_new(n);
+}
+#if __cplusplus >= 201103L
+void *operator new[](size_t n) {
+#else
+void *operator new[](size_t n) throw(std::bad_alloc) {
+#endif
+	return pooled_new(n);
+}
+void *operator new(size_t n, const std::nothrow_t &) throw() {
+	try {
+		return pooled_new(n);
+	} catch(...) {
+		return 0;
+	}
+}
+void *operator new[](size_t n, const std::nothrow_t &) throw() {
+	try {
+		return pooled_new(n);
+	} catch(...) {
+		return 0;
+	}
+}
+
+void operator delete(void *p) throw() {
+	pooled_delete(p);
+}
+void operator delete[](void *p) throw() {
+	pooled_delete(p);
+}
+void operator delete(void *p, const std::nothrow_t &) throw() {
+	pooled_delete(p);
+}
+void operator delete[](void *p, const std::nothrow_t &) throw() {
+	pooled_delete(p);
+}
+
+#if __cpp_sized_deallocation
+// (the size is not needed, the pointer tells the class)
+void operator delete(void *p, size_t) noexcept {
+	pooled_delete(p);
+}
+void operator delete[](void *p, size_t) noexcept {
+	pooled_delete(p);
+}
+#endif
+
+#if __cpp_aligned_new
+void *operator new(size_t n, std::align_val_t align) {
+	return pooled_new(n, size_t(align));
+}
+void *operator new[](size_t n, std::align_val_t align) {
+	return pooled_new(n, size_t(align));
+}
+void *operator new(size_t n, std::align_val_t align, const std::nothrow_t &) noexcept {
+	try {
+		return pooled_new(n, size_t(align));
+	} catch(...) {
+		return 0;
+	}
+}
+void *operator new[](size_t n, std::align_val_t align, const std::nothrow_t &) noexcept {
+	try {
+		return pooled_new(n, size_t(align));
+	} catch(...) {
+		return 0;
+	}
+}
+void operator delete(void *p, std::align_val_t) noexcept {
+	pooled_delete(p);
+}
+void operator delete[](void *p, std::align_val_t) noexcept {
+	pooled_delete(p);
+}
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+	pooled_delete(p);
+}
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+	pooled_delete(p);
+}
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+	pooled_delete(p);
+}
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+	pooled_delete(p);
+}
+#endif
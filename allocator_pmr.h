@@ -0,0 +1,117 @@
+/*
+allocator_pmr.h - cutepig pools as std::pmr memory resources
+Copyright (C) 2011  Christian Holmberg
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef ALLOCATOR_PMR_H_INCLUDED
+#define ALLOCATOR_PMR_H_INCLUDED
+
+#include "allocator.h"
+
+// needs C++17 and a library that has it
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+
+#include <memory_resource>
+
+namespace cutepig {
+
+	/*
+		The block pools as a memory resource. Whatever fits a size class comes
+		from the shared pools of that class (see block_size_pools), the rest is
+		passed on to upstream. All resources with the same Policy share the
+		same pools, so they compare equal.
+	*/
+	template <typename Policy = block_policy>
+	class block_pool_resource : public std::pmr::memory_resource {
+	public:
+		typedef block_size_pools<Policy> pools;
+
+		explicit block_pool_resource(std::pmr::memory_resource *upstream = std::pmr::get_default_resource()) noexcept
+			: up(upstream)
+		{}
+
+		std::pmr::memory_resource *upstream_resource() const noexcept
+		{ return up; }
+
+	protected:
+		void *do_allocate(size_t bytes, size_t alignment) override {
+			size_t n = round(bytes, alignment);
+			if(!pools::pooled(n, alignment))
+				return up->allocate(bytes, alignment);
+			void *p = pools::allocate(n);
+			if(!p)
+				throw std::bad_alloc();
+			return p;
+		}
+
+		void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+			size_t n = round(bytes, alignment);
+			if(!pools::pooled(n, alignment))
+				up->deallocate(p, bytes, alignment);
+			else
+				pools::deallocate(p, n);
+		}
+
+		bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+			const block_pool_resource *o = dynamic_cast<const block_pool_resource*>(&other);
+			return o && o->up->is_equal(*up);
+		}
+
+	private:
+		std::pmr::memory_resource *up;
+
+		// a slot is aligned to the largest power of two dividing its size
+		static size_t round(size_t bytes, size_t alignment) {
+			return (bytes + alignment - 1) & ~(alignment - 1);
+		}
+	};
+
+	/*
+		An arena as a memory resource (monotonic, deallocate does nothing).
+		The arena is only referenced, reset() or release() it when done.
+	*/
+	class arena_resource : public std::pmr::memory_resource {
+	public:
+		explicit arena_resource(arena &a) noexcept
+			: ar(&a)
+		{}
+
+		arena &get_arena() const noexcept
+		{ return *ar; }
+
+	protected:
+		void *do_allocate(size_t bytes, size_t alignment) override
+		{ return ar->allocate(bytes, alignment); }
+
+		void do_deallocate(void *, size_t, size_t) override
+		{}
+
+		bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+			const arena_resource *o = dynamic_cast<const arena_resource*>(&other);
+			return o && o->ar == ar;
+		}
+
+	private:
+		arena *ar;
+	};
+}
+
+#endif
+#endif
+
+#endif // ALLOCATOR_PMR_H_INCLUDED
@@ -0,0 +1,145 @@
+/*
+	malloc/free on the cutepig pools for any program (libcutepig_preload.so)
+
+	LD_PRELOAD=./libcutepig_preload.so program
+
+	what fits a size class goes to the thread cached block pools, the rest
+	(and whatever the pools need for themselves) to the glibc heap through
+	its __libc_ entry points. operator new of libstdc++ calls malloc, so
+	C++ programs are covered too. build with -ftls-model=initial-exec, a
+	malloc can not wait for the dynamic TLS of a shared object.
+*/
+#include "allocator_global.h"
+
+#include <errno.h>
+#include <pthread.h>	// pthread_atfork
+#include <dlfcn.h>	// dlsym for the malloc_usable_size of glibc
+
+extern "C" {
+	void *__libc_malloc(size_t);
+	void *__libc_calloc(size_t, size_t);
+	void *__libc_realloc(void *, size_t);
+	void *__libc_memalign(size_t, size_t);
+	void __libc_free(void *);
+}
+
+namespace {
+	typedef cutepig::global_pools<> pools;
+
+	// set while the pools run, their own mallocs (thread lists) go to glibc
+	__thread int inside = 0;
+
+	void *pooled(size_t n, size_t align) {
+		if(inside)
+			return 0;
+		inside = 1;
+		void *p = pools::allocate(n, align);
+		inside = 0;
+		return p;
+	}
+
+	// the child of a fork has only the forking thread, so no pool lock may be
+	// held then (the child gives them back like the parent)
+	__attribute__((constructor)) void fork_safe() {
+		pthread_atfork(&pools::lock, &pools::unlock, &pools::unlock);
+	}
+
+	// room for n bytes aligned to align (a power of two), 0 if out of memory.
+	// the class must be a multiple of align, round() alone gives 8 byte slots
+	void *aligned(size_t n, size_t align) {
+		void *p = 0;
+		if(!(align & (align - 1)) && align <= cutepig::cache_line_size)
+			p = pooled((std::max(pools::round(n), align) + align - 1) & ~(align - 1), align);
+		return p ? p : __libc_memalign(align, n);
+	}
+}
+
+extern "C" {
+
+void *malloc(size_t n) {
+	void *p = pooled(pools::round(n), 16);
+	return p ? p : __libc_malloc(n);
+}
+
+void free(void *p) {
+	if(!p)
+		return;
+	if(pools::owns(p))
+		pools::deallocate(p);
+	else
+		__libc_free(p);
+}
+void cfree(void *p) {
+	free(p);
+}
+
+void *calloc(size_t count, size_t size) {
+	if(size && count > size_t(-1) / size) {
+		errno = ENOMEM;
+		return 0;
+	}
+	size_t n = count * size;
+	void *p = pooled(pools::round(n), 16);
+	if(!p)
+		return __libc_calloc(count, size);
+	// (slots are reused, not zero)
+	memset(p, 0, n);
+	return p;
+}
+
+void *realloc(void *p, size_t n) {
+	if(!p)
+		return malloc(n);
+	if(!pools::owns(p))
+		return __libc_realloc(p, n);
+	if(!n) {
+		free(p);
+		return 0;
+	}
+	size_t have = pools::usable_size(p);
+	if(n <= have && pools::round(n) > have / 2)
+		return p;
+	void *r = malloc(n);
+	if(r) {
+		memcpy(r, p, n < have ? n : have);
+		free(p);
+	}
+	return r;
+}
+
+size_t malloc_usable_size(void *p) {
+	if(!p)
+		return 0;
+	if(pools::owns(p))
+		return pools::usable_size(p);
+	// glibc's own, it can not be named directly from here
+	static size_t (*libc_usable)(void *) = 0;
+	if(!libc_usable)
+		libc_usable = reinterpret_cast<size_t (*)(void *)>(dlsym(RTLD_NEXT, "malloc_usable_size"));
+	return libc_usable ? libc_usable(p) : 0;
+}
+
+int posix_memalign(void **out, size_t align, size_t n) {
+	if(!align || (align & (align - 1)) || align % sizeof(void*))
+		return EINVAL;
+	void *p = aligned(n, align);
+	if(!p)
+		return ENOMEM;
+	*out = p;
+	return 0;
+}
+void *memalign(size_t align, size_t n) {
+	return aligned(n, align);
+}
+void *aligned_alloc(size_t align, size_t n) {
+	return aligned(n, align);
+}
+void *valloc(size_t n) {
+	return __libc_memalign(cutepig::mmap_chunks<>::page_size(), n);
+}
+void *pvalloc(size_t n) {
+	size_t page = cutepig::mmap_chunks<>::page_size();
+	return __libc_memalign(page, (n + page - 1) & ~(page - 1));
+}
+
+}
@@ -0,0 +1,276 @@
+/*
+allocator_profiler.h - sampling heap profiler for the cutepig allocators
+Copyright (C) 2011  Christian Holmberg
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef ALLOCATOR_PROFILER_H_INCLUDED
+#define ALLOCATOR_PROFILER_H_INCLUDED
+
+#include "allocator.h"
+
+#include <execinfo.h>	// backtrace
+#include <cxxabi.h>	// demangling for the folded stacks
+#include <stdio.h>
+#include <string.h>
+
+namespace cutepig {
+
+	// one sampled allocation
+	struct heap_sample {
+		static const int max_depth = 32;
+		size_t seq;		// even when the record is complete, see heap_profile
+		size_t size;		// of the allocation that was sampled
+		size_t weight;		// bytes this sample stands for
+		int depth;
+		void *stack[max_depth];
+	};
+
+	/*
+		The samples of one Tag, in a ring of the last Slots samples.
+		Writers take a record with one atomic add and guard it with a sequence
+		number (odd while being written), so nothing ever blocks and a reader
+		just skips records that are being rewritten.
+	*/
+	template <typename Tag = void, int Slots = 4096>
+	struct heap_profile {
+		static heap_sample *ring() {
+			static heap_sample r[Slots];
+			return r;
+		}
+		static size_t &next() {
+			static size_t n = 0;
+			return n;
+		}
+
+		// record the calling stack for an allocation of 'size', standing for 'weight' bytes
+		// (never inlined, its own frame and its caller's are skipped)
+		static void record(size_t size, size_t weight) __attribute__((noinline)) {
+			void *stack[heap_sample::max_depth + max_skip];
+			int n = backtrace(stack, heap_sample::max_depth + max_skip);
+			// up to the frame of the caller, wherever it is (sanitizers wrap
+			// backtrace in frames of their own)
+			int skip = 0;
+			while(skip < max_skip && skip < n && stack[skip] != __builtin_return_address(0))
+				skip++;
+			skip = skip < max_skip && skip < n ? skip + 1 : 2;
+			int depth = std::min(n - skip, int(heap_sample::max_depth));
+			if(depth < 0)
+				depth = 0;
+			size_t i = __atomic_fetch_add(&next(), 1, __ATOMIC_RELAXED);
+			heap_sample &s = ring()[i % Slots];
+			size_t seq = __atomic_load_n(&s.seq, __ATOMIC_RELAXED);
+			// someone else is writing this one (the ring went around meanwhile), drop it
+			if((seq & 1) || !__atomic_compare_exchange_n(&s.seq, &seq, seq + 1,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			s.size = size;
+			s.weight = weight;
+			s.depth = depth;
+			memcpy(s.stack, stack + skip, depth * sizeof(void*));
+			__atomic_store_n(&s.seq, seq + 2, __ATOMIC_RELEASE);
+		}
+
+		// number of samples taken so far (the ring keeps the last Slots)
+		static size_t samples() {
+			return __atomic_load_n(&next(), __ATOMIC_RELAXED);
+		}
+
+		// consistent copy of the samples in the ring, returns how many (at most Slots)
+		static int snapshot(heap_sample *out) {
+			int n = 0;
+			for(int i = 0; i < Slots; i++) {
+				heap_sample &s = ring()[i];
+				size_t seq = __atomic_load_n(&s.seq, __ATOMIC_ACQUIRE);
+				if(!seq || (seq & 1))
+					continue;
+				out[n] = s;
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if(__atomic_load_n(&s.seq, __ATOMIC_RELAXED) == seq)
+					n++;
+			}
+			return n;
+		}
+
+		// forget all samples (not while allocating from other threads)
+		static void reset() {
+			memset(ring(), 0, sizeof(heap_sample) * Slots);
+			__atomic_store_n(&next(), size_t(0), __ATOMIC_RELAXED);
+		}
+
+		/*
+			Folded stacks, one line per call stack (root first, frames separated
+			by ';') and the bytes sampled there, as flamegraph.pl and friends
+			read them. Frames are named with backtrace_symbols, so functions of
+			the executable need -rdynamic to show up by name.
+		*/
+		static bool write_folded(FILE *f) {
+			int n;
+			heap_sample *s = sorted(n);
+			if(!s)
+				return false;
+			for(int i = 0; i < n; ) {
+				size_t bytes = 0;
+				int j = i;
+				for(; j < n && same_stack(s[i], s[j]); j++)
+					bytes += s[j].weight;
+				char **names = backtrace_symbols(s[i].stack, s[i].depth);
+				for(int d = s[i].depth - 1; d >= 0; d--) {
+					write_frame(f, names ? names[d] : 0, s[i].stack[d]);
+					if(d)
+						fputc(';', f);
+				}
+				fprintf(f, " %lu\n", (unsigned long)bytes);
+				free(names);
+				i = j;
+			}
+			free(s);
+			return true;
+		}
+
+		/*
+			The legacy text heap profile of gperftools, 'pprof <binary> <file>'
+			reads it. Every stack is listed with its sample count and bytes
+			(as both in use and allocated, deallocations are not tracked),
+			followed by the mappings of the process for symbolization.
+		*/
+		static bool write_pprof(FILE *f) {
+			int n;
+			heap_sample *s = sorted(n);
+			if(!s)
+				return false;
+			size_t total_count = 0, total_bytes = 0;
+			for(int i = 0; i < n; i++) {
+				total_count += s[i].weight / (s[i].size ? s[i].size : 1);
+				total_bytes += s[i].weight;
+			}
+			fprintf(f, "heap profile: %lu: %lu [%lu: %lu] @ heapprofile\n",
+				(unsigned long)total_count, (unsigned long)total_bytes,
+				(unsigned long)total_count, (unsigned long)total_bytes);
+			for(int i = 0; i < n; ) {
+				size_t count = 0, bytes = 0;
+				int j = i;
+				for(; j < n && same_stack(s[i], s[j]); j++) {
+					count += s[j].weight / (s[j].size ? s[j].size : 1);
+					bytes += s[j].weight;
+				}
+				fprintf(f, "%lu: %lu [%lu: %lu] @", (unsigned long)count, (unsigned long)bytes,
+					(unsigned long)count, (unsigned long)bytes);
+				for(int d = 0; d < s[i].depth; d++)
+					fprintf(f, " %p", s[i].stack[d]);
+				fputc('\n', f);
+				i = j;
+			}
+			free(s);
+
+			fprintf(f, "\nMAPPED_LIBRARIES:\n");
+			FILE *maps = fopen("/proc/self/maps", "r");
+			if(maps) {
+				char buf[4096];
+				size_t r;
+				while((r = fread(buf, 1, sizeof(buf), maps)) > 0)
+					fwrite(buf, 1, r, f);
+				fclose(maps);
+			}
+			return true;
+		}
+
+	private:
+		// most frames looked at for the caller of record()
+		static const int max_skip = 4;
+
+		static bool same_stack(const heap_sample &a, const heap_sample &b) {
+			return a.depth == b.depth && !memcmp(a.stack, b.stack, a.depth * sizeof(void*));
+		}
+		static int compare(const void *a, const void *b) {
+			const heap_sample *x = static_cast<const heap_sample*>(a), *y = static_cast<const heap_sample*>(b);
+			if(x->depth != y->depth)
+				return x->depth < y->depth ? -1 : 1;
+			return memcmp(x->stack, y->stack, x->depth * sizeof(void*));
+		}
+		// snapshot sorted by stack, so equal stacks are next to each other (free() it)
+		static heap_sample *sorted(int &n) {
+			heap_sample *s = static_cast<heap_sample*>(malloc(sizeof(heap_sample) * Slots));
+			if(!s)
+				return 0;
+			n = snapshot(s);
+			qsort(s, n, sizeof(heap_sample), &compare);
+			return s;
+		}
+
+		// "binary(mangled+0x12) [0x...]" as a demangled function name, or the address
+		static void write_frame(FILE *f, const char *sym, void *addr) {
+			const char *open = sym ? strchr(sym, '(') : 0;
+			const char *end = open ? strpbrk(open, "+)") : 0;
+			if(!end || end == open + 1) {
+				fprintf(f, "%p", addr);
+				return;
+			}
+			char mangled[512];
+			size_t len = size_t(end - open - 1) < sizeof(mangled) - 1 ? size_t(end - open - 1) : sizeof(mangled) - 1;
+			memcpy(mangled, open + 1, len);
+			mangled[len] = 0;
+			int status;
+			char *name = abi::__cxa_demangle(mangled, 0, 0, &status);
+			// ';' separates frames, ' ' the count
+			for(const char *c = name ? name : mangled; *c; c++)
+				fputc(*c == ';' || *c == ' ' ? '_' : *c, f);
+			free(name);
+		}
+	};
+
+	/*
+		Stats policy that samples allocations, on average one per Rate bytes.
+		Every thread counts down the bytes it allocates and when it crosses
+		zero the calling stack goes to heap_profile<Tag> (weighted with the
+		bytes it stands for), so the cost is a thread local subtraction per
+		allocation and a backtrace per Rate bytes. Everything is also passed
+		on to Inner, to keep counting_stats for example.
+	*/
+	template <typename Tag = void, size_t Rate = 512 * 1024, typename Inner = null_stats>
+	struct sampling_stats {
+		typedef heap_profile<Tag> profile;
+
+		static void allocated(size_t n) {
+			Inner::allocated(n);
+			long &left = countdown();
+			left -= long(n);
+			if(left <= 0)
+				sample(n);
+		}
+		static void deallocated(size_t n) { Inner::deallocated(n); }
+		static void block_allocated(size_t n) { Inner::block_allocated(n); }
+		static void block_freed(size_t n) { Inner::block_freed(n); }
+
+	private:
+		static long &countdown() {
+			static __thread long left = long(Rate);
+			return left;
+		}
+		// kept out of line so the fast path stays small
+		static void sample(size_t n) __attribute__((noinline)) {
+			long &left = countdown();
+			// the bytes since the last sample (more than Rate if n was big)
+			size_t weight = size_t(long(Rate) - left);
+			left = long(Rate);
+			profile::record(n, weight);
+			// not a tail call, record() finds this frame by its return address
+			__asm__ __volatile__("" ::: "memory");
+		}
+	};
+}
+
+#endif // ALLOCATOR_PROFILER_H_INCLUDED
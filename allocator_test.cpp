@@ -1,12 +1,29 @@
 #include <iostream>
 #include "allocator.h"
+#include "allocator_pmr.h"
+#include "allocator_profiler.h"
+#include "allocator_global.h"
 
 #include <list>
 #include <vector>
 #include <map>
+#include <string>
+#include <algorithm>
 
 #include <cstdlib>
 #include <cstring>
+#include <cassert>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#if __cplusplus >= 201103L
+	#include <unordered_map>
+	#include <memory>
+#endif
+#if __cplusplus >= 201703L
+	#include <memory_resource>
+#endif
 
 template<typename T>
 void print_container(const T &container) {
@@ -14,6 +31,270 @@ void print_container(const T &container) {
 		std::cout << *it << " ";
 }
 
+// counters for the malloc_allocator tests, printed after each test
+typedef cutepig::counting_stats<> test_stats;
+
+void print_stats() {
+	cutepig::alloc_stats s = test_stats::get();
+	std::cout << "allocations " << s.allocations << ", deallocations " << s.deallocations
+		<< ", live " << s.live_bytes << " bytes, peak " << s.peak_bytes << " bytes" << std::endl;
+}
+
+// counters for the growing_buffer test
+struct grow_tag;
+typedef cutepig::counting_stats<grow_tag> grow_stats;
+
+// counters for what short_allocator sends to malloc
+struct short_tag;
+typedef cutepig::counting_stats<short_tag> short_stats;
+
+// block_allocator with its own counters
+struct counting_block_policy : cutepig::block_policy {
+	typedef cutepig::counting_stats<counting_block_policy> stats;
+};
+
+// blocks from mmap regions
+struct mmap_block_policy : cutepig::block_policy {
+	typedef cutepig::mmap_chunks<64 * 1024> chunks;
+};
+// page sized ones
+struct mmap_page_policy : mmap_block_policy {
+	typedef cutepig::filled_blocks<> layout;
+};
+
+// same size class as the nodes of a std::list<int>
+struct list_node { void *p[3]; };
+
+// pools of their own for the compaction test
+struct compact_block_policy : cutepig::block_policy {};
+
+// block_allocator with its own counters for the batch test
+struct batch_block_policy : cutepig::block_policy {
+	typedef cutepig::counting_stats<batch_block_policy> stats;
+};
+
+// checked slots, errors are thrown back to the test
+struct checked_block_policy : cutepig::block_policy {
+	typedef cutepig::checked_slots checks;
+};
+void throw_check(const char *what, const void *) {
+	throw what;
+}
+// or counted and skipped
+int skipped_checks = 0;
+void skip_check(const char *, const void *) {
+	skipped_checks++;
+}
+
+// checked slots on thread lists, for the remote double free test
+struct checked_concurrent_policy : cutepig::concurrent_block_policy {
+	typedef cutepig::checked_slots checks;
+};
+typedef cutepig::block_allocator<long, cutepig::block_slots<long>::value,
+	checked_concurrent_policy> remote_calloc;
+long *remote_slots[3];
+void *thread_remote_slots(void *) {
+	remote_calloc a;
+	for(int i=0; i<3; i++)
+		remote_slots[i] = a.allocate(1);
+	return 0;
+}
+
+// checked slots held by a global until exit, not leaks (make test-checked
+// fails on anything in the exit report)
+std::list<long, cutepig::block_allocator<long, cutepig::block_slots<long>::value,
+	checked_block_policy> > kept_till_exit;
+// what a checked operation ran into, 0 if nothing
+template <typename F> const char *check_error(F f) {
+	try {
+		f();
+	} catch(const char *what) {
+		return what;
+	}
+	return 0;
+}
+
+// sampled every 1k, on top of counting
+struct profile_tag;
+typedef cutepig::sampling_stats<profile_tag, 1024, cutepig::counting_stats<profile_tag> > profile_stats;
+typedef std::list<int, cutepig::malloc_allocator<int, profile_stats> > profiled_list;
+
+// a call site of its own for the profile
+__attribute__((noinline)) void profiled_fill(profiled_list &l, int n) {
+	for(int i=0; i<n; i++)
+		l.push_back(i);
+}
+
+// where a sampled stack may start: in the allocation path down from
+// profiled_fill, however much of it was inlined, never in the profiler
+bool allocation_frame(const char *f) {
+	static const char *known[] = { "::allocated(", "::allocate(", "::push_back(",
+		"_M_insert", "_M_create_node", "_M_get_node(" };
+	if(!strncmp(f, "profiled_fill(", 14))
+		return true;
+	for(size_t i=0; i<sizeof(known)/sizeof(known[0]); i++)
+		if(strstr(f, known[i]))
+			return true;
+	return false;
+}
+
+// pools of their own for the placement hint test
+struct hint_block_policy : cutepig::block_policy {};
+
+// other slot layouts
+struct packed_block_policy : cutepig::block_policy {
+	typedef cutepig::packed_slots layout;
+};
+struct padded_block_policy : cutepig::concurrent_block_policy {
+	typedef cutepig::padded_slots layout;
+};
+struct filled_block_policy : cutepig::block_policy {
+	typedef cutepig::filled_blocks<> layout;
+};
+
+// one line of the layout report
+void print_layout(const char *name, const cutepig::block_layout &l) {
+	std::cout << "  " << name << ": object " << l.object_size << ", slot " << l.slot_size
+		<< " x " << l.slots << ", header " << l.header_bytes << ", block " << l.block_bytes
+		<< " (span " << l.block_span << "), " << l.bytes_per_object << " bytes per object" << std::endl;
+}
+
+// no default constructor, counts constructions and destructions
+struct counted {
+	static int constructed, destroyed;
+	std::string s;
+	explicit counted(const char *str) : s(str) { constructed++; }
+	counted(const counted &other) : s(other.s) { constructed++; }
+	~counted() { destroyed++; }
+};
+int counted::constructed = 0, counted::destroyed = 0;
+
+// lists shared between threads for the thread_cached test
+struct thread_block_policy : cutepig::concurrent_block_policy {
+	typedef cutepig::counting_stats<thread_block_policy> stats;
+};
+typedef std::list<int, cutepig::block_allocator<int, cutepig::block_slots<int>::value,
+	thread_block_policy> > clist;
+const int THREADS = 4, COUNT_T = 20000;
+clist *clists[THREADS * 2];
+
+// fill own list, then free half of another threads list while filling another one
+void *thread_fill(void *arg) {
+	long t = (long)arg;
+	int i;
+	clists[t] = new clist;
+	for(i=0; i<COUNT_T; i++)
+		clists[t]->push_back(i);
+	return 0;
+}
+void *thread_swap(void *arg) {
+	long t = (long)arg;
+	int i;
+	clist *other = clists[(t + 1) % THREADS];
+	clists[THREADS + t] = new clist;
+	for(i=0; i<COUNT_T; i++) {
+		clists[THREADS + t]->push_back(i);
+		if(i&1)
+			other->pop_front();
+	}
+	return 0;
+}
+
+// lists on simulated NUMA nodes, thread t runs on node t
+typedef std::list<int, cutepig::block_allocator<int, cutepig::block_slots<int>::value,
+	cutepig::numa_block_policy> > nlist;
+nlist *nlists[2];
+
+void *thread_node(void *arg) {
+	long t = (long)arg;
+	int i;
+	cutepig::numa_topology::set_thread_node(int(t));
+	nlists[t] = new nlist;
+	for(i=0; i<COUNT_T; i++)
+		nlists[t]->push_back(i);
+	return 0;
+}
+
+// objects passed around between threads for the lockfree test
+struct lf_object { long id, check; char pad[48]; };
+struct lf_tag;
+typedef cutepig::lockfree_allocator<lf_object, cutepig::counting_stats<lf_tag> > lf_alloc;
+const int LF_THREADS = 8, LF_SWAPS = 64, COUNT_LF = 100000;
+lf_object *lf_swap[LF_SWAPS];
+int lf_errors = 0;
+
+// allocate, swap with what another thread left, check and free that
+void *thread_lockfree(void *arg) {
+	long t = (long)arg;
+	lf_alloc a;
+	for(long i=0; i<COUNT_LF; i++) {
+		lf_object *p = a.allocate(1);
+		p->id = t << 32 | i;
+		p->check = ~p->id;
+		p = __atomic_exchange_n(&lf_swap[(t + i) % LF_SWAPS], p, __ATOMIC_ACQ_REL);
+		if(!p)
+			continue;
+		if(p->check != ~p->id)
+			__atomic_add_fetch(&lf_errors, 1, __ATOMIC_RELAXED);
+		a.deallocate(p, 1);
+	}
+	return 0;
+}
+
+// a cache on a 256k budget (4k batches) that sheds half of itself at 192k
+struct cache_tag;
+typedef cutepig::memory_budget<cache_tag, 4096> cache_budget;
+typedef std::list<int, cutepig::budget_allocator<int, cache_budget,
+	cutepig::block_allocator<int, cutepig::block_slots<int>::value, cutepig::concurrent_block_policy> > > cache_list;
+cache_list *cache;
+int cache_evictions = 0;
+
+void evict_cache(size_t) {
+	cache_evictions++;
+	size_t n = cache->size() / 2;
+	while(n--)
+		cache->pop_front();
+}
+
+// charge and release a lot from many threads
+void *thread_budget(void *) {
+	cache_list l;
+	for(int i=0; i<COUNT_T; i++) {
+		l.push_back(i);
+		if(i & 1)
+			l.pop_front();
+	}
+	return 0;
+}
+
+// charged on one thread, released on another
+cache_list *handed_over;
+void *thread_produce(void *) {
+	handed_over = new cache_list;
+	for(int i=0; i<1000; i++)
+		handed_over->push_back(i);
+	return 0;
+}
+void *thread_consume(void *) {
+	delete handed_over;
+	return 0;
+}
+
+// new/delete of every size class, for the fork test (on the global pools
+// under make test-global)
+void *thread_churn(void *) {
+	for(int round=0; round<100; round++) {
+		char *p[64];
+		for(int i=0; i<64; i++)
+			p[i] = new char[1 + (round * 64 + i) % 1024];
+		for(int i=0; i<64; i++)
+			delete[] p[i];
+		// (the pool locks are taken on the slow paths)
+		cutepig::global_pools<>::trim();
+	}
+	return 0;
+}
+
 int main()
 {
 	int i, j;	// predeclare some looping variables
@@ -45,15 +326,974 @@ int main()
 
 	//===================================
 
+	// use the allocator directly, enough to span several blocks
+	// (tiny objects get multi-word bitmaps, so use both char and long)
+	std::cout << "block_allocator slot test" << std::endl;
+	{
+		typedef cutepig::block_allocator<long, cutepig::block_slots<long>::value, counting_block_policy> lalloc_type;
+		cutepig::block_allocator<char> challoc;
+		lalloc_type lalloc;
+		const int COUNT_C = 3 * cutepig::block_allocator<char>::pool::number_of_slots + 1;
+		const int COUNT_L = 3 * lalloc_type::pool::number_of_slots + 1;
+		std::vector<char*> cptrs;
+		std::vector<long*> lptrs;
+
+		for(i=0; i<COUNT_C; i++) {
+			cptrs.push_back(challoc.allocate(1));
+			*cptrs.back() = char(i);
+		}
+		for(i=0; i<COUNT_L; i++) {
+			lptrs.push_back(lalloc.allocate(1));
+			*lptrs.back() = i;
+		}
+		for(i=0; i<COUNT_C; i++)
+			assert(*cptrs[i] == char(i));
+		for(i=0; i<COUNT_L; i++)
+			assert(*lptrs[i] == i);
+
+		// free every other, then the rest backwards
+		for(i=0; i<COUNT_L; i+=2)
+			lalloc.deallocate(lptrs[i], 1);
+		for(i=COUNT_L-1; i>=0; i--) {
+			if(i&1)
+				lalloc.deallocate(lptrs[i], 1);
+		}
+		// empty blocks are kept (down to retention::low once above high)
+		cutepig::alloc_stats bs = cutepig::counting_stats<counting_block_policy>::get();
+		assert(bs.allocations == size_t(COUNT_L) && bs.live_bytes == 0);
+		assert(bs.blocks_allocated == 4 && bs.blocks_freed == 0);
+
+		// alternating at a block boundary does not go to the system
+		for(i=0; i<COUNT_L; i++)
+			lptrs[i] = lalloc.allocate(1);
+		for(i=0; i<1000; i++) {
+			long *l = lalloc.allocate(1);
+			lalloc.deallocate(l, 1);
+		}
+		bs = cutepig::counting_stats<counting_block_policy>::get();
+		assert(bs.blocks_allocated == 4 && bs.blocks_freed == 0);
+		for(i=0; i<COUNT_L; i++)
+			lalloc.deallocate(lptrs[i], 1);
+
+		lalloc.trim();
+		bs = cutepig::counting_stats<counting_block_policy>::get();
+		assert(bs.blocks_allocated == 4 && bs.blocks_freed == 4);
+		for(i=0; i<COUNT_C; i++)
+			challoc.deallocate(cptrs[i], 1);
+	}
+
+	//===================================
+
+	// heap chunks come in runs, found again from any of their chunks
+	std::cout << "malloc chunk test" << std::endl;
+	{
+		typedef cutepig::malloc_chunks::provider<1000, 512> provider;
+		// runs of 1, 2 .. 64 chunks, then of 64 (all carved to the end)
+		const int COUNT = 127 + 14 * 64;
+		std::vector<void*> chunks;
+		for(i=0; i<COUNT; i++) {
+			chunks.push_back(provider::allocate());
+			assert(chunks.back() && reinterpret_cast<uintptr_t>(chunks.back()) % 512 == 0);
+		}
+		size_t runs = provider::nruns;
+		assert(runs > 1 && !provider::open);
+		for(i=COUNT-1; i>0; i--)
+			std::swap(chunks[i], chunks[rand() % (i + 1)]);
+		// half released, then taken again from the runs they came from
+		for(i=0; i<COUNT/2; i++)
+			provider::deallocate(chunks[i]);
+		for(i=0; i<COUNT/2; i++)
+			chunks[i] = provider::allocate();
+		assert(provider::nruns == runs && !provider::open);
+		for(i=0; i<COUNT; i++)
+			provider::deallocate(chunks[i]);
+		assert(provider::nruns == 0 && !provider::open);
+	}
+
+	//===================================
+
+	// blocks are carved one after another from a region, released ones are reused
+	std::cout << "block_allocator mmap chunk test" << std::endl;
+	{
+		typedef cutepig::block_allocator<long, cutepig::block_slots<long>::value, mmap_block_policy> alloc;
+		typedef alloc::pool::block_list list;
+		alloc lalloc;
+		const int COUNT = 3 * alloc::pool::number_of_slots;
+		std::vector<long*> ptrs;
+		for(i=0; i<COUNT; i++) {
+			ptrs.push_back(lalloc.allocate(1));
+			*ptrs.back() = i;
+		}
+		char *b0 = (char*)list::blockof(ptrs[0]);
+		char *b1 = (char*)list::blockof(ptrs[alloc::pool::number_of_slots]);
+		assert(b1 - b0 == (long)list::block_alignment);
+		for(i=0; i<COUNT; i++) {
+			assert(*ptrs[i] == i);
+			lalloc.deallocate(ptrs[i], 1);
+		}
+		lalloc.trim();
+		// blocks smaller than a page too, once all blocks of the page are released
+		size_t page = size_t(sysconf(_SC_PAGESIZE));
+		unsigned char resident = 1;
+		assert(mincore((void*)((uintptr_t)b0 & ~(page - 1)), page, &resident) == 0);
+		assert(list::block_alignment >= page || !(resident & 1));
+		long *l = lalloc.allocate(1);
+		assert((char*)list::blockof(l) == b0 || (char*)list::blockof(l) == b1);
+		lalloc.deallocate(l, 1);
+		lalloc.trim();
+
+		// and page sized blocks
+		typedef cutepig::block_allocator<long, cutepig::block_slots<long>::value, mmap_page_policy> palloc;
+		palloc pa;
+		ptrs.clear();
+		for(i=0; i<3 * palloc::pool::number_of_slots; i++)
+			ptrs.push_back(pa.allocate(1));
+		char *pb = (char*)palloc::pool::block_list::blockof(ptrs[0]);
+		assert(palloc::pool::block_list::block_alignment == page);
+		for(i=0; i<(int)ptrs.size(); i++)
+			pa.deallocate(ptrs[i], 1);
+		pa.trim();
+		assert(mincore(pb, page, &resident) == 0 && !(resident & 1));
+	}
+
+	//===================================
+
+	// burst then partial drain leaves sparse blocks, compact packs them again
+	std::cout << "block_allocator compaction test" << std::endl;
+	{
+		typedef std::list<int, cutepig::block_allocator<int, cutepig::block_slots<int>::value,
+			compact_block_policy> > plist;
+		// the pool of the list nodes, not of int
+		cutepig::block_allocator<list_node, cutepig::block_slots<list_node>::value, compact_block_policy> nodes;
+		plist burst;
+		for(i=0; i<10000; i++)
+			burst.push_back(i);
+		for(plist::iterator it = burst.begin(); it != burst.end(); ) {
+			if(*it % 50)
+				it = burst.erase(it);
+			else
+				++it;
+		}
+		cutepig::block_occupancy before = nodes.occupancy();
+		assert(burst.size() == 200 && before.slots == 200);
+		assert(before.slots * 10 < before.capacity);
+		assert(before.histogram[0] == before.blocks);
+
+		cutepig::compact(burst);
+		cutepig::block_occupancy after = nodes.occupancy();
+		assert(burst.size() == 200 && burst.front() == 0 && burst.back() == 9950);
+		assert(after.slots == 200 && after.sealed == 0);
+		assert(after.blocks < before.blocks && after.slots * 2 > after.capacity);
+	}
+
+	//===================================
+
+	// containers on heaps of their own
+	std::cout << "block_allocator heap test" << std::endl;
+	{
+		typedef cutepig::block_allocator<int, cutepig::block_slots<int>::value, counting_block_policy> ialloc;
+		typedef std::list<int, ialloc> hlist;
+		typedef cutepig::block_heap<counting_block_policy> heap;
+		cutepig::block_allocator<list_node, cutepig::block_slots<list_node>::value, counting_block_policy> nodes;
+		nodes.trim();
+		cutepig::alloc_stats bs = cutepig::counting_stats<counting_block_policy>::get();
+		size_t blocks_before = bs.blocks_allocated - bs.blocks_freed;
+
+		// a heap on the stack, referenced
+		{
+			heap h;
+			hlist a((ialloc(h))), b((ialloc(h))), c;
+			for(i=0; i<1000; i++) {
+				a.push_back(i);
+				b.push_back(i);
+				c.push_back(i);
+			}
+			assert(a.get_allocator() == b.get_allocator() && a.get_allocator().get_heap() == &h);
+			assert(a.get_allocator() != c.get_allocator());
+			// a and b share blocks, c is elsewhere
+			assert(hlist::allocator_type::block_list::blockof(&a.front())
+				!= hlist::allocator_type::block_list::blockof(&c.front()));
+			a.splice(a.end(), b);
+			assert(a.size() == 2000 && b.empty());
+			c.clear();
+		}
+		nodes.trim();
+		bs = cutepig::counting_stats<counting_block_policy>::get();
+		assert(bs.blocks_allocated - bs.blocks_freed == blocks_before);
+
+		// an owned heap, gone with the last container using it
+		{
+			hlist *big = new hlist((ialloc(*heap::create())));
+			for(i=0; i<10000; i++)
+				big->push_back(i);
+			hlist copy(*big);
+			assert(copy.get_allocator() == big->get_allocator());
+			delete big;
+			assert(copy.size() == 10000 && copy.back() == 9999);
+		}
+		bs = cutepig::counting_stats<counting_block_policy>::get();
+		assert(bs.blocks_allocated - bs.blocks_freed == blocks_before);
+	}
+
+	//===================================
+
+	// what the layouts cost per object, and where the slots are
+	std::cout << "block_allocator layout test" << std::endl;
+	{
+		typedef cutepig::block_allocator<list_node> defaults;
+		typedef cutepig::block_allocator<list_node, cutepig::block_slots<list_node>::value, packed_block_policy> packed;
+		typedef cutepig::block_allocator<list_node, cutepig::block_slots<list_node>::value, padded_block_policy> padded;
+		typedef cutepig::block_allocator<list_node, cutepig::block_slots<list_node>::value, filled_block_policy> filled;
+		print_layout("default", defaults::layout_report());
+		print_layout("packed", packed::layout_report());
+		print_layout("padded", padded::layout_report());
+		print_layout("filled", filled::layout_report());
+
+		// by default blocks fill the span they are aligned to
+		cutepig::block_layout l = defaults::layout_report();
+		assert(l.block_bytes <= l.block_span && l.block_span - l.block_bytes < l.slot_size + cutepig::cache_line_size);
+		assert(l.slots >= cutepig::block_slots<list_node>::value);
+		assert(l.bytes_per_object < packed::layout_report().bytes_per_object);
+
+		l = padded::layout_report();
+		assert(l.slot_size == 64 && l.slot_align == 64);
+		l = filled::layout_report();
+		assert(l.block_bytes <= l.block_span && l.block_span >= 4096);
+		assert(l.block_span - l.block_bytes < l.slot_size + cutepig::cache_line_size);
+		assert(l.bytes_per_object < packed::layout_report().bytes_per_object);
+
+		// slots start after the header, on cache lines of their own when padded
+		padded pa;
+		list_node *a = pa.allocate(1), *b = pa.allocate(1);
+		assert((uintptr_t)a % 64 == 0 && (uintptr_t)b % 64 == 0 && a != b);
+		assert((char*)a - (char*)padded::block_list::blockof(a) >= 64);
+		pa.deallocate(a, 1);
+		pa.deallocate(b, 1);
+
+		filled fa;
+		std::vector<list_node*> nodes;
+		for(i=0; i<3 * filled::pool::number_of_slots; i++)
+			nodes.push_back(fa.allocate(1));
+		for(i=0; i<3 * filled::pool::number_of_slots; i++)
+			fa.deallocate(nodes[i], 1);
+		fa.trim();
+	}
+
+	//===================================
+
+	// many objects at once, and containers bulk loaded
+	std::cout << "block_allocator batch test" << std::endl;
+	{
+		typedef cutepig::block_allocator<long, cutepig::block_slots<long>::value, batch_block_policy> lalloc;
+		typedef cutepig::counting_stats<batch_block_policy> bstats;
+		const int COUNT_B = 1000, slots = lalloc::pool::number_of_slots;
+		lalloc a;
+		std::vector<long*> ptrs(COUNT_B);
+		a.allocate_batch(COUNT_B, &ptrs[0]);
+		for(i=0; i<COUNT_B; i++)
+			*ptrs[i] = i;
+		std::vector<long*> sorted(ptrs);
+		std::sort(sorted.begin(), sorted.end());
+		assert(std::unique(sorted.begin(), sorted.end()) == sorted.end());
+		for(i=0; i<COUNT_B; i++)
+			assert(*ptrs[i] == i);
+		cutepig::alloc_stats bs = bstats::get();
+		assert(bs.allocations == size_t(COUNT_B) && bs.blocks_allocated == size_t((COUNT_B + slots - 1) / slots));
+		a.deallocate_batch(&ptrs[0], COUNT_B);
+		a.trim();
+		bs = bstats::get();
+		assert(bs.live_bytes == 0 && bs.blocks_freed == bs.blocks_allocated);
+
+		// the thread_cached pools
+		cutepig::block_allocator<long, cutepig::block_slots<long>::value, cutepig::concurrent_block_policy> ca;
+		ca.allocate_batch(COUNT_B, &ptrs[0]);
+		ca.deallocate_batch(&ptrs[0], COUNT_B);
+
+		// list and map from a range, the nodes come a word at a time
+		std::vector<int> values;
+		for(i=0; i<COUNT_B; i++)
+			values.push_back(i);
+		std::list<int, cutepig::block_allocator<int, cutepig::block_slots<int>::value, batch_block_policy> > blist;
+		std::map<int, int, std::less<int>,
+			cutepig::block_allocator<std::pair<const int, int>, cutepig::block_slots<std::pair<const int, int> >::value,
+			batch_block_policy> > bmap;
+		std::vector<std::pair<int, int> > pairs;
+		for(i=0; i<COUNT_B; i++)
+			pairs.push_back(std::make_pair(i, -i));
+		cutepig::insert_batched(blist, values.begin(), values.end());
+		cutepig::insert_batched(bmap, pairs.begin(), pairs.end());
+		assert(blist.size() == size_t(COUNT_B) && blist.back() == COUNT_B - 1);
+		assert(bmap.size() == size_t(COUNT_B) && bmap[COUNT_B / 2] == -COUNT_B / 2);
+		// neighbours in the list are neighbours in memory
+		assert((char*)&*++blist.begin() - (char*)&*blist.begin()
+			== (long)sizeof(cutepig::block_allocator<list_node, cutepig::block_slots<list_node>::value,
+				batch_block_policy>::pool::slot));
+		blist.clear();
+		bmap.clear();
+		cutepig::block_allocator<list_node, cutepig::block_slots<list_node>::value, batch_block_policy>().trim();
+		bs = bstats::get();
+		assert(bs.live_bytes == 0);
+	}
+
+	//===================================
+
+	// checked slots catch what would otherwise go by silently
+	std::cout << "block_allocator checks test" << std::endl;
+	{
+		typedef cutepig::block_allocator<long, cutepig::block_slots<long>::value, checked_block_policy> calloc;
+		typedef cutepig::block_allocator<double, cutepig::block_slots<double>::value, checked_block_policy> dalloc;
+		// (each cleans up after itself so nothing is left for the exit report)
+		struct ops {
+			static void double_free() { calloc a; long *p = a.allocate(1); a.deallocate(p, 1); a.deallocate(p, 1); }
+			static void not_a_slot() {
+				calloc a;
+				long *p = a.allocate(1);
+				try {
+					a.deallocate((long*)((char*)p + 4), 1);
+				} catch(...) {
+					a.deallocate(p, 1);
+					throw;
+				}
+			}
+			static void overrun() {
+				calloc a;
+				long *p = a.allocate(1);
+				long canary = p[1];
+				p[1] = 0;
+				try {
+					a.deallocate(p, 1);
+				} catch(...) {
+					p[1] = canary;
+					a.deallocate(p, 1);
+					throw;
+				}
+			}
+			static void after_free() {
+				calloc a;
+				long *p = a.allocate(1);
+				a.deallocate(p, 1);
+				p[0] = 0;	// the first word is not checked, the rest (canary too) is
+				p[1] = 0;
+				try {
+					a.deallocate(a.allocate(1), 1);
+				} catch(...) {
+					// the slot was taken anyway, with a fresh canary
+					a.deallocate(p, 1);
+					throw;
+				}
+			}
+			static void foreign() {
+				cutepig::block_heap<checked_block_policy> h;
+				calloc shared;
+				calloc own(h);
+				long *p = own.allocate(1);
+				try {
+					shared.deallocate(p, 1);
+				} catch(...) {
+					own.deallocate(p, 1);
+					throw;
+				}
+			}
+		};
+		cutepig::checked_slots::on_error() = &throw_check;
+		assert(check_error(&ops::double_free) == std::string("double free"));
+		assert(check_error(&ops::not_a_slot) == std::string("pointer is not a slot"));
+		assert(check_error(&ops::overrun) == std::string("overrun past the end of the object"));
+		assert(check_error(&ops::after_free) == std::string("write after free"));
+		assert(check_error(&ops::foreign) == std::string("pointer of another allocator"));
+
+		// live slots per type
+		long before = cutepig::checked_slots::report_leaks(0);
+		assert(before == 0);
+		calloc a;
+		dalloc b;
+		long *l = a.allocate(1);
+		double *d = b.allocate(1);
+		assert(cutepig::checked_slots::report_leaks(0) == before + 2);
+		a.deallocate(l, 1);
+		b.deallocate(d, 1);
+		assert(cutepig::checked_slots::report_leaks(0) == before);
+		a.trim();
+		b.trim();
+
+		// freed twice to the list of an exited thread: the remote queue goes
+		// around in a cycle behind the last slot, collecting it must not
+		pthread_t t;
+		pthread_create(&t, 0, &thread_remote_slots, 0);
+		pthread_join(t, 0);
+		cutepig::checked_slots::on_error() = &skip_check;
+		remote_calloc c;
+		c.deallocate(remote_slots[0], 1);
+		c.deallocate(remote_slots[1], 1);
+		c.deallocate(remote_slots[0], 1);
+		c.deallocate(remote_slots[2], 1);
+		c.trim();
+		assert(skipped_checks == 1);
+		// (the second free was counted, nothing tells it from a good one there)
+		assert(cutepig::checked_slots::report_leaks(0) == before - 1);
+		cutepig::checked_slots::live<long>(1);
+		cutepig::checked_slots::on_error() = &throw_check;
+
+		// freed only by its destructor, before the exit report
+		kept_till_exit.assign(100, 1L);
+	}
+
+	//===================================
+
+	// sampled call stacks, as folded stacks and a pprof heap profile
+	std::cout << "sampling profiler test" << std::endl;
+	{
+		typedef profile_stats::profile profile;
+		profiled_list l;
+		profiled_fill(l, 10000);
+		cutepig::alloc_stats ps = cutepig::counting_stats<profile_tag>::get();
+		// one per 1k and the node that crossed it
+		assert(profile::samples() <= ps.live_bytes / 1024 && profile::samples() >= ps.live_bytes / (1024 + 24));
+
+		FILE *f = tmpfile();
+		assert(profile::write_folded(f));
+		rewind(f);
+		char line[4096];
+		size_t sampled = 0, here = 0;
+		while(fgets(line, sizeof(line), f)) {
+			char *count = strrchr(line, ' ');
+			assert(count);
+			sampled += strtoul(count + 1, 0, 10);
+			// the last frame (a wrong skip leaves one of the profiler's there)
+			*count = 0;
+			const char *leaf = strrchr(line, ';');
+			assert(allocation_frame(leaf ? leaf + 1 : line));
+			// by the call site alone, profiled_fill is never inlined (the frames
+			// between it and the sample depend on the optimization level)
+			if(strstr(line, ";profiled_fill("))
+				here += strtoul(count + 1, 0, 10);
+		}
+		fclose(f);
+		// every sample stands for the bytes since the one before
+		assert(sampled <= ps.live_bytes && sampled > ps.live_bytes - 1024);
+		assert(here == sampled);
+
+		f = tmpfile();
+		assert(profile::write_pprof(f));
+		rewind(f);
+		assert(fgets(line, sizeof(line), f) && !strncmp(line, "heap profile: ", 14));
+		bool mapped = false;
+		while(fgets(line, sizeof(line), f))
+			mapped = mapped || !strcmp(line, "MAPPED_LIBRARIES:\n");
+		fclose(f);
+		assert(mapped);
+		profile::reset();
+		assert(profile::samples() == 0);
+	}
+
+	//===================================
+
+	// types of the same size class share their blocks
+	std::cout << "block_allocator size class test" << std::endl;
+	{
+		cutepig::block_allocator<long> lalloc;
+		cutepig::block_allocator<double> dalloc;
+		long *l1 = lalloc.allocate(1);
+		double *d = dalloc.allocate(1);
+		long *l2 = lalloc.allocate(1);
+		// one block, next free slots (a slot is a long, and a canary when checked)
+		const size_t stride = sizeof(cutepig::block_allocator<long>::pool::slot);
+		assert((char*)d == (char*)l1 + stride);
+		assert((char*)l2 == (char*)d + stride);
+		lalloc.deallocate(l1, 1);
+		dalloc.deallocate(d, 1);
+		lalloc.deallocate(l2, 1);
+
+		// both list nodes are three pointers
+		std::list<long, cutepig::block_allocator<long> > llist;
+		std::list<void*, cutepig::block_allocator<void*> > plist;
+		for(i=0; i<COUNT_J; i++) {
+			llist.push_back(i);
+			plist.push_back(0);
+		}
+		// (every other slot, the llist nodes are in between)
+		assert((char*)&*++plist.begin() - (char*)&*plist.begin()
+			== 2 * (long)sizeof(cutepig::block_allocator<list_node>::pool::slot));
+	}
+
+	//===================================
+
+#if __cplusplus >= 201103L
+	// allocator_traits, nodes come from the pool and arrays from the system
+	std::cout << "block_allocator C++11 test" << std::endl;
+	{
+		typedef cutepig::block_allocator<std::pair<const int, int> > palloc;
+		static_assert(!std::allocator_traits<palloc>::is_always_equal::value, "stateful (heaps)");
+		static_assert(!std::allocator_traits<cutepig::arena_allocator<int> >::is_always_equal::value, "stateful");
+
+		std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, palloc> umap;
+		for(i=0; i<COUNT_I * COUNT_J * 100; i++)
+			umap.emplace(i, -i);
+		for(i=0; i<COUNT_I * COUNT_J * 100; i+=2)
+			umap.erase(i);
+		assert(umap.size() == COUNT_I * COUNT_J * 50 && umap[1] == -1);
+
+		std::vector<int, cutepig::block_allocator<int> > bvector;
+		for(i=0; i<COUNT_I * COUNT_J * 100; i++)
+			bvector.push_back(i);
+		assert(bvector[COUNT_J] == COUNT_J);
+
+		std::list<std::pair<int, std::string>, cutepig::block_allocator<std::pair<int, std::string> > > plist;
+		plist.emplace_back(1, "emplaced");
+		assert(plist.front().second == "emplaced");
+	}
+#endif
+
+	//===================================
+
+#if __cplusplus >= 201703L
+	// pmr containers, resources picked at runtime
+	std::cout << "memory_resource test" << std::endl;
+	{
+		cutepig::arena request;
+		cutepig::arena_resource arena_res(request);
+		// small sizes from the pools, large ones from the arena
+		cutepig::block_pool_resource<> pool_res(&arena_res);
+		std::pmr::memory_resource *resources[] = { &pool_res, &arena_res, std::pmr::new_delete_resource() };
+
+		for(std::pmr::memory_resource *res : resources) {
+			std::pmr::list<int> plist(res);
+			std::pmr::map<int, std::pmr::string> pmap(res);
+			std::pmr::vector<double> pvector(res);
+			for(i=0; i<COUNT_I * COUNT_J * 10; i++) {
+				plist.push_back(i);
+				pmap[i] = "a string long enough not to fit in the string itself";
+				pvector.push_back(i);
+			}
+			for(i=0; i<COUNT_I * COUNT_J * 10; i+=2)
+				pmap.erase(i);
+			assert(plist.back() == i - 1 && pmap.size() == size_t(i / 2) && pvector[1] == 1);
+			assert(pmap.get_allocator().resource() == res);
+		}
+		assert(pool_res.is_equal(cutepig::block_pool_resource<>(&arena_res)));
+		assert(!pool_res.is_equal(arena_res));
+		std::cout << "arena took " << request.reserved() << " bytes" << std::endl;
+	}
+#endif
+
+	//===================================
+
+	// slots are raw storage, the pool never constructs anything in them
+	std::cout << "block_allocator raw storage test" << std::endl;
+	{
+		typedef cutepig::block_allocator<counted> alloc;
+		alloc a;
+		counted *p = a.allocate(1);
+		assert(counted::constructed == 0);
+		// slots start on a cache line of their own
+		assert(reinterpret_cast<uintptr_t>(alloc::block_list::blockof(p)->ptr) % cutepig::cache_line_size == 0);
+		assert((char*)alloc::block_list::blockof(p)->ptr - (char*)alloc::block_list::blockof(p)
+			>= (std::ptrdiff_t)cutepig::cache_line_size);
+		a.construct(p, counted("strings in block slots"));
+		a.destroy(p);
+		a.deallocate(p, 1);
+
+		std::list<counted, alloc> nlist;
+		for(i=0; i<COUNT_J; i++)
+			nlist.push_back(counted("node"));
+		nlist.clear();
+		assert(counted::constructed == 2 + 2 * COUNT_J);
+		assert(counted::destroyed == counted::constructed);
+	}
+
+	//===================================
+
+	// thread_cached lists, frees from other threads and lists of exited threads
+	std::cout << "block_allocator thread test" << std::endl;
+	{
+		pthread_t threads[THREADS];
+		long t;
+
+		for(t=0; t<THREADS; t++)
+			pthread_create(&threads[t], 0, thread_fill, (void*)t);
+		for(t=0; t<THREADS; t++)
+			pthread_join(threads[t], 0);
+
+		for(t=0; t<THREADS; t++)
+			pthread_create(&threads[t], 0, thread_swap, (void*)t);
+		for(t=0; t<THREADS; t++)
+			pthread_join(threads[t], 0);
+
+		for(t=0; t<THREADS; t++) {
+			assert(clists[t]->size() == COUNT_T / 2);
+			assert(clists[t]->front() == COUNT_T / 2);
+			assert(clists[THREADS + t]->size() == COUNT_T);
+		}
+		for(t=0; t<THREADS * 2; t++)
+			delete clists[t];
+		// all freed here, into the lists the exited threads left behind
+		cutepig::block_allocator<list_node, cutepig::block_slots<list_node>::value,
+			thread_block_policy>::pool::trim();
+		cutepig::alloc_stats bs = cutepig::counting_stats<thread_block_policy>::get();
+		assert(bs.blocks_allocated > 0 && bs.blocks_freed == bs.blocks_allocated);
+	}
+
+	//===================================
+
+	// per node lists on a simulated two node machine
+	std::cout << "block_allocator numa test" << std::endl;
+	{
+		typedef cutepig::block_allocator<list_node, cutepig::block_slots<list_node>::value,
+			cutepig::numa_block_policy>::pool pool;
+		pthread_t threads[2];
+		long t;
+
+		// the node of the cpu we are on, from the table
+		int here = cutepig::numa_topology::current_node();
+		assert(here >= 0 && here < cutepig::numa_topology::nodes());
+
+		// blocks come from regions bound to their node as a whole, also blocks
+		// smaller than a page (before simulating, which binds nothing)
+		typedef cutepig::block_allocator<std::pair<long, long>, cutepig::block_slots<std::pair<long, long> >::value,
+			cutepig::numa_block_policy> palloc;
+		cutepig::numa_topology::set_thread_node(0);
+		palloc pa;
+		std::pair<long, long> *pp = pa.allocate(1);
+		int mode = -1;
+		unsigned long mask = 0;
+		// (MPOL_F_ADDR: the policy of the page pp is on, kernels without NUMA fail the call)
+		if(syscall(SYS_get_mempolicy, &mode, &mask, sizeof(mask) * 8, pp, 2) == 0)
+			assert(mode == 1 && mask == 1);		// MPOL_PREFERRED, node 0
+		pa.deallocate(pp, 1);
+		cutepig::numa_topology::set_thread_node(-1);
+
+		cutepig::numa_topology::simulate(2);
+		assert(cutepig::numa_topology::nodes() == 2);
+		for(t=0; t<2; t++)
+			pthread_create(&threads[t], 0, thread_node, (void*)t);
+		for(t=0; t<2; t++)
+			pthread_join(threads[t], 0);
+
+		for(t=0; t<2; t++) {
+			cutepig::numa_usage u = pool::usage(int(t));
+			assert(u.slots == size_t(COUNT_T) && u.blocks > 0);
+			assert(pool::block_list::blockof(&nlists[t]->front())->owner->node == t);
+		}
+		// freed from node 0, the slots go back to the list of node 1
+		cutepig::numa_topology::set_thread_node(0);
+		delete nlists[1];
+		assert(pool::usage(1).slots == 0 && pool::usage(1).blocks == 0);
+		delete nlists[0];
+		assert(pool::usage(0).slots == 0);
+		pool::trim();
+		assert(pool::usage(0).cached == 0 && pool::usage(1).cached == 0);
+		cutepig::numa_topology::set_thread_node(-1);
+		cutepig::numa_topology::simulate(0);
+	}
+
+	//===================================
+
+	// many threads on one lockfree pool, objects freed by others than who made them
+	std::cout << "lockfree_allocator test" << std::endl;
+	{
+		typedef cutepig::counting_stats<lf_tag> stats;
+		pthread_t threads[LF_THREADS];
+		long t;
+
+		for(t=0; t<LF_THREADS; t++)
+			pthread_create(&threads[t], 0, thread_lockfree, (void*)t);
+		for(t=0; t<LF_THREADS; t++)
+			pthread_join(threads[t], 0);
+		assert(lf_errors == 0);
+
+		lf_alloc a;
+		for(i=0; i<LF_SWAPS; i++)
+			if(lf_swap[i])
+				a.deallocate(lf_swap[i], 1);
+		assert(stats::get().live_bytes == 0);
+		assert(stats::get().allocations == size_t(LF_THREADS) * COUNT_LF);
+		// live objects never went over threads + swap slots, neither did the pool
+		assert(lf_alloc::pool::capacity() <= 2 * 1024 && stats::get().blocks_freed == 0);
+		std::cout << "capacity " << lf_alloc::pool::capacity() << " slots, "
+			<< stats::get().blocks_allocated << " chunks" << std::endl;
+
+		// nodes of a list<int> are list_node sized, freed ones are reused
+		typedef cutepig::lockfree_allocator<list_node>::pool node_pool;
+		std::list<int, cutepig::lockfree_allocator<int> > l(1000);
+		assert(node_pool::capacity() == 1024);
+		l.clear();
+		l.resize(1000);
+		assert(node_pool::capacity() == 1024);
+	}
+
+	//===================================
+
+	// nodes placed next to their neighbours after churn
+	std::cout << "block_allocator hint test" << std::endl;
+	{
+		typedef cutepig::block_allocator<int, cutepig::block_slots<int>::value, hint_block_policy> alloc;
+		typedef std::list<int, alloc> hlist;
+		typedef alloc::rebind<list_node>::other::block_list block_list;
+		typedef alloc::rebind<list_node>::other::pool::slot slot;
+		const int n = 4 * alloc::rebind<list_node>::other::pool::number_of_slots;
+		hlist l;
+		std::list<int, alloc> other;
+
+		// every other node gone, the blocks are half full
+		for(i=0; i<n; i++)
+			l.push_back(i);
+		hlist::iterator it = l.begin();
+		while(it != l.end() && ++it != l.end())
+			it = l.erase(it);
+		// a plain insert takes the first free slot of the head block, not near the front
+		other.push_back(-1);
+		assert(block_list::blockof(&other.front()) != block_list::blockof(&l.front()));
+		other.clear();
+		// near inserts fill the slot next to each node
+		int adjacent = 0;
+		for(it = l.begin(); it != l.end(); ++it) {
+			hlist::iterator ins = cutepig::insert_near(l, it, -*it);
+			assert(block_list::blockof(&*ins) == block_list::blockof(&*it));
+			long d = long(reinterpret_cast<char*>(&*ins) - reinterpret_cast<char*>(&*it));
+			if(d == long(sizeof(slot)) || d == -long(sizeof(slot)))
+				adjacent++;
+		}
+		std::cout << adjacent << " of " << n / 2 << " next to their neighbour" << std::endl;
+		assert(adjacent == n / 2);
+
+		// the blocks are full again, a hint into one of them is taken to
+		// a block next to it in the list
+		alloc::rebind<list_node>::other a;
+		l.push_back(n);
+		alloc::rebind<list_node>::other::pool::block_block *b = block_list::blockof(&l.front());
+		assert(!b->hasroom());
+		list_node *p = a.allocate(1, &l.front());
+		assert(block_list::blockof(p) == b->prev || block_list::blockof(p) == b->next);
+		a.deallocate(p, 1);
+	}
+
+	//===================================
+
+	// the pools behind global new/delete and malloc/free
+	std::cout << "global_pools test" << std::endl;
+	{
+		typedef cutepig::global_pools<> pools;
+		void *p = pools::allocate(pools::round(20));
+		assert(p && pools::owns(p) && pools::usable_size(p) == 32);
+		assert(reinterpret_cast<uintptr_t>(p) % 16 == 0);
+		void *q = pools::allocate(pools::round(100));
+		assert(pools::owns(q) && pools::usable_size(q) == 112);
+		// over aligned, a multiple of the alignment
+		void *a = pools::allocate(128, 64);
+		assert(pools::owns(a) && reinterpret_cast<uintptr_t>(a) % 64 == 0);
+		// too big for a class, for the system heap
+		assert(!pools::allocate(4096));
+		void *m = malloc(4096);
+		assert(!pools::owns(m));
+		free(m);
+		// small sizes asked with an alignment (on the pools under make test-global)
+		void *held[2][48];
+		for(size_t n = 1; n <= 48; n++) {
+			assert(posix_memalign(&held[0][n - 1], 16, n) == 0);
+			assert(reinterpret_cast<uintptr_t>(held[0][n - 1]) % 16 == 0);
+			assert(posix_memalign(&held[1][n - 1], 32, n) == 0);
+			assert(reinterpret_cast<uintptr_t>(held[1][n - 1]) % 32 == 0);
+		}
+		for(size_t n = 0; n < 48; n++)
+			free(held[0][n]), free(held[1][n]);
+#if __cpp_aligned_new
+		// zero bytes with an alignment (on the pools under make test-global)
+		for(size_t n = 0; n < 48; n++) {
+			held[0][n] = operator new(0, std::align_val_t(32));
+			assert(reinterpret_cast<uintptr_t>(held[0][n]) % 32 == 0);
+		}
+		for(size_t n = 0; n < 48; n++)
+			operator delete(held[0][n], std::align_val_t(32));
+#endif
+		pools::deallocate(a);
+		pools::deallocate(q);
+		pools::deallocate(p);
+		pools::trim();
+
+		// forks while other threads allocate, no lock may be left held in the child
+		// (not with a sanitizer, whose own allocator is not fork safe)
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+		for(int round=0; round<20; round++) {
+			pthread_t threads[THREADS];
+			for(long t=0; t<THREADS; t++)
+				pthread_create(&threads[t], 0, &thread_churn, 0);
+			pid_t pid = fork();
+			if(!pid) {
+				// (a lock that is never given back ends the child)
+				alarm(10);
+				pthread_t child;
+				thread_churn(0);
+				pthread_create(&child, 0, &thread_churn, 0);
+				pthread_join(child, 0);
+				_exit(0);
+			}
+			int status;
+			assert(pid > 0 && waitpid(pid, &status, 0) == pid);
+			assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+			for(long t=0; t<THREADS; t++)
+				pthread_join(threads[t], 0);
+		}
+#endif
+	}
+
+	//===================================
+
+	// a budget on a cache, shedding at the soft limit and refusing at the hard one
+	std::cout << "memory_budget test" << std::endl;
+	{
+		cache_budget::set_limits(256 * 1024, 192 * 1024, &evict_cache);
+		cache = new cache_list;
+		for(i=0; i<100000; i++)
+			cache->push_back(i);
+		std::cout << cache_evictions << " evictions, " << cache->size() << " left, "
+			<< cache_budget::used() << " bytes used" << std::endl;
+		assert(cache_evictions > 0 && cache_budget::used() <= 256 * 1024);
+
+		// no soft handler, then the hard limit
+		cache_budget::set_limits(256 * 1024);
+		bool refused = false;
+		try {
+			for(;;)
+				cache->push_back(0);
+		} catch(std::bad_alloc &) {
+			refused = true;
+		}
+		assert(refused && cache_budget::rejected() > 0);
+		cache_list::allocator_type a = cache->get_allocator();
+		// (the last node did not fit, a bigger array does not either)
+		assert(!a.try_allocate(8));
+		size_t used = cache_budget::used();
+		assert(used <= 256 * 1024 && used > 256 * 1024 - 2 * 4096);
+		cache->clear();
+		cache_budget::flush();
+		assert(cache_budget::used() == 0);
+		int *p = a.try_allocate(1);
+		assert(p);
+		a.deallocate(p, 1);
+
+		// the advances of threads are given back when they exit
+		pthread_t threads[THREADS];
+		long t;
+		cache_budget::set_limits(0);
+		for(t=0; t<THREADS; t++)
+			pthread_create(&threads[t], 0, thread_budget, 0);
+		for(t=0; t<THREADS; t++)
+			pthread_join(threads[t], 0);
+		cache_budget::flush();
+		assert(cache_budget::used() == 0);
+		// also the advance of a thread that only releases
+		for(i=0; i<10; i++) {
+			pthread_create(&threads[0], 0, thread_produce, 0);
+			pthread_join(threads[0], 0);
+			pthread_create(&threads[0], 0, thread_consume, 0);
+			pthread_join(threads[0], 0);
+		}
+		assert(cache_budget::used() == 0);
+		delete cache;
+	}
+
+	//===================================
+
+	// per request containers on an arena
+	std::cout << "arena_allocator test" << std::endl;
+	{
+		typedef std::basic_string<char, std::char_traits<char>, cutepig::arena_allocator<char> > astring;
+		cutepig::arena request(4096), other;
+		cutepig::arena_allocator<int> ialloc(request);
+
+		for(i=0; i<COUNT_I; i++) {
+			std::list<int, cutepig::arena_allocator<int> > alist(ialloc);
+			std::vector<int, cutepig::arena_allocator<int> > avector(ialloc);
+			std::map<int, int, std::less<int>, cutepig::arena_allocator<std::pair<const int, int> > > amap(
+				std::less<int>(), ialloc);
+			astring s(ialloc);
+
+			for(j=0; j<COUNT_J * 100; j++) {
+				alist.push_back(j);
+				avector.push_back(j);
+				amap[j] = j;
+				s += "arena ";
+			}
+			assert(alist.back() == avector.back() && amap[j-1] == j-1);
+			std::cout << "reserved " << request.reserved() << " bytes" << std::endl;
+		}
+		// containers are gone, then all memory at once (one chunk is kept)
+		size_t reserved = request.reserved();
+		request.reset();
+		assert(request.reserved() > 0 && request.reserved() < reserved);
+
+		// rebound allocators compare equal only on the same arena
+		assert(ialloc == cutepig::arena_allocator<char>(request));
+		assert(ialloc != cutepig::arena_allocator<int>(other));
+		request.release();
+		assert(request.reserved() == 0);
+	}
+
+	//===================================
+
+	// small containers on the stack, malloc only when they outgrow it
+	std::cout << "short_allocator test" << std::endl;
+	{
+		typedef cutepig::short_allocator<int, 512, short_stats> salloc;
+		typedef std::basic_string<char, std::char_traits<char>,
+			cutepig::short_allocator<char, 512, short_stats> > sstring;
+		salloc::arena_type ar, other;
+		{
+			std::vector<int, salloc> v((salloc(ar)));
+			sstring s((salloc(ar)));
+			v.reserve(16);
+			for(i=0; i<16; i++) {
+				v.push_back(i);
+				s += "short ";
+			}
+			assert(ar.owns(&v[0]) && ar.owns(s.data()));
+			assert(short_stats::get().allocations == 0);
+			// rebound allocators compare equal only on the same arena
+			assert(v.get_allocator() == s.get_allocator());
+			assert(v.get_allocator() != salloc(other));
+
+			// outgrown, then the rest goes to malloc
+			for(i=0; i<1000; i++)
+				v.push_back(i);
+			assert(!ar.owns(&v[0]) && short_stats::get().allocations > 0);
+			std::cout << "arena used " << ar.used() << " of " << salloc::arena_type::size
+				<< " bytes, " << short_stats::get().allocations << " mallocs" << std::endl;
+		}
+		assert(short_stats::get().live_bytes == 0);
+		// swapped with a container on another arena, the arenas go along
+		{
+			std::vector<int, salloc> v((salloc(ar))), w((salloc(other)));
+			v.push_back(1);
+			w.push_back(2);
+			w.push_back(3);
+			v.swap(w);
+			assert(v.size() == 2 && w.size() == 1 && w[0] == 1);
+			assert(other.owns(&v[0]) && v.get_allocator() == salloc(other));
+			assert(ar.owns(&w[0]) && w.get_allocator() == salloc(ar));
+			v.push_back(4);
+		}
+		assert(short_stats::get().live_bytes == 0);
+		other.reset();
+		// the latest allocation is given back
+		ar.reset();
+		salloc a(ar);
+		int *p = a.allocate(10);
+		a.deallocate(p, 10);
+		assert(ar.used() == 0);
+	}
+
+	//===================================
+
 	// on gcc, list allocates elements at a time
 	std::cout << "list test" << std::endl;
 
-	std::list<int, cutepig::malloc_allocator<int> > ilist;
+	std::list<int, cutepig::malloc_allocator<int, test_stats> > ilist;
 	for(i=0; i<COUNT_I; i++) {
 		std::cout << "inserting 10 values into list" << std::endl;
 		for(j=0; j<COUNT_J; j++) {
 			ilist.push_back(i);
 		}
+		print_stats();
 	}
 	for(i=0; i<COUNT_I; i++) {
 		std::cout << "removing 10 values from list" << std::endl;
@@ -64,7 +1304,10 @@ int main()
 			else
 				ilist.pop_back();
 		}
+		print_stats();
 	}
+	assert(test_stats::get().live_bytes == 0);
+	assert(test_stats::get().allocations == COUNT_I * COUNT_J);
 
 	//====================================
 
@@ -78,29 +1321,30 @@ int main()
     	}
     }
 
-	std::list<int, cutepig::malloc_allocator<int> > ilist2;
+	std::list<int, cutepig::malloc_allocator<int, test_stats> > ilist2;
 
 	std::cout << "list::assign( begin, end)" << std::endl;
 	// on gcc, this copies elements 1 by 1
 	ilist2.assign( ilist.begin(), ilist.end() );
+	print_stats();
 
 	std::cout << "list copy ctor" << std::endl;
 	// on gcc, this copies elements 1 by 1
-	std::list<int, cutepig::malloc_allocator<int> > ilist3( ilist2 );
-
-	return 0;
+	std::list<int, cutepig::malloc_allocator<int, test_stats> > ilist3( ilist2 );
+	print_stats();
 
     //====================================
 
 	// on gcc, vector allocation policy seems to be N rounded to next 2^x
     std::cout << "vector test" << std::endl;
 
-    std::vector<float, cutepig::malloc_allocator<float> > ivector;
+    std::vector<float, cutepig::malloc_allocator<float, test_stats> > ivector;
     for(i=0; i<COUNT_I; i++) {
     	std::cout << "inserting 10 values into vector" << std::endl;
     	for(j=0; j<COUNT_J; j++) {
 			ivector.push_back(i);
     	}
+    	print_stats();
     }
 
     for(i=0; i<COUNT_I; i++) {
@@ -118,7 +1362,7 @@ int main()
 
 	const int LARGE_SIZE = 100000000;
 	const int LARGE_CHUNKS = 16;
-    std::vector<int, cutepig::malloc_allocator<int> > ivector2( LARGE_SIZE, 12345678 );
+    std::vector<int, cutepig::malloc_allocator<int, test_stats> > ivector2( LARGE_SIZE, 12345678 );
     for(i=0; i < LARGE_CHUNKS; i++) {
     	std::size_t offset = (((LARGE_CHUNKS - 1) - i ) * (LARGE_SIZE / LARGE_CHUNKS));
     	std::cout << "removing from vector range " << std::dec << offset << " " << ivector2.size() << std::endl;
@@ -132,18 +1376,66 @@ int main()
     // on gcc, even this doesnt free memory!
     ivector2.resize(0);
 #endif
+    //====================================
+
+	// the slack malloc hands back as capacity, growing in place or by remapping
+	std::cout << "growing_buffer test" << std::endl;
+	{
+		typedef grow_stats stats;
+		cutepig::malloc_allocator<int, stats> a;
+
+		cutepig::allocation_result<int*> r = a.allocate_at_least(13);
+		assert(r.count >= 13 && r.count == a.usable_size(r.ptr));
+		std::cout << "asked 13, got " << r.count << std::endl;
+		assert(a.expand(r.ptr, r.count, r.count) && !a.expand(r.ptr, r.count, r.count * 1000));
+		// into the slack of a plain allocate, then freed with the new count
+		int *e = a.allocate(10);
+		size_t live = stats::get().live_bytes;
+		assert(a.expand(e, 10, a.usable_size(e)));
+		a.deallocate(e, a.usable_size(e));
+		assert(stats::get().live_bytes == live - 10 * sizeof(int));
+		for(i=0; i<int(r.count); i++)
+			r.ptr[i] = i;
+		// past the mmap threshold of malloc, then grown by remapping
+		r = a.reallocate(r.ptr, r.count, 1 << 20);
+		assert(r.count >= 1 << 20 && r.ptr[12] == 12);
+		r.ptr[(1 << 20) - 1] = 1;
+		r = a.reallocate(r.ptr, r.count, 1 << 24);
+		assert(r.count >= 1 << 24 && r.ptr[12] == 12 && r.ptr[(1 << 20) - 1] == 1);
+		a.deallocate(r.ptr, r.count);
+		assert(stats::get().live_bytes == 0);
+
+		cutepig::growing_buffer<int, stats> buf;
+		for(i=0; i<1000000; i++)
+			buf.push_back(i);
+		assert(buf.size() == 1000000 && buf.capacity() >= buf.size() && buf[999999] == 999999);
+		std::cout << buf.size() << " ints in " << stats::get().allocations << " allocations" << std::endl;
+		// appending from itself, across a grow
+		buf.shrink_to_fit();
+		buf.append(buf.data(), 10);
+		buf.push_back(buf[5]);
+		assert(buf.size() == 1000011 && buf[1000009] == 9 && buf.back() == 5);
+		cutepig::growing_buffer<int, stats> copy(buf);
+		buf.resize(10);
+		assert(copy.size() == 1000011 && copy[999999] == 999999 && buf.size() == 10);
+		buf.swap(copy);
+		assert(buf.size() == 1000011 && copy.size() == 10);
+	}
+	assert(grow_stats::get().live_bytes == 0);
+
     //====================================
 
     // lets see what map does for allocation
     // on gcc, map allocates elements at a time
     std::cout << "map test" << std::endl;
-    std::map< int, int, std::less<int>, cutepig::malloc_allocator<std::pair<int, int> > > imap;
+    std::map< int, int, std::less<int>, cutepig::malloc_allocator<std::pair<int, int>, test_stats> > imap;
 
 	for(i = 0; i < COUNT_I; i++ ) {
 		std::cout << "inserting 10 values to map" << std::endl;
 		for(j = 0; j < COUNT_J; j++ ) {
 			imap[ rand() & 0xffff ] = rand();
 		}
+		print_stats();
 	}
 
 	//====================================
@@ -154,7 +1446,7 @@ int main()
 
 	// string test.. override stl string with this
 	std::cout << "string test" << std::endl;
-	typedef std::basic_string<char, std::char_traits<char>, cutepig::malloc_allocator<char> > string;
+	typedef std::basic_string<char, std::char_traits<char>, cutepig::malloc_allocator<char, test_stats> > string;
 	string s;
 
 	// just some random stuff
@@ -183,4 +1475,5 @@ int main()
 	std::cout << "ok..?" << std::endl;
 	s = "dippidappa";
 	std::cout << "ok.." << std::endl;
+	print_stats();
 }